@@ -0,0 +1,191 @@
+// Tap 2 MIDI meter
+// Displays the input levels and detector states that tap2midi -O name publishes in shared memory
+
+/*
+ *      This program is free software; you can redistribute it and/or modify it
+ *      under the terms of the GNU General Public License as published by the
+ *      Free Software Foundation; either version 2 of the License,
+ *      or (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ *
+*/
+
+// Compile with:
+// gcc -O2 tap2meter.c -lm -o tap2meter
+// Use example, while ./tap2midi -D hw:3,0 -O tap2midi runs:
+// ./tap2meter tap2midi
+// Print the meters once, e.g. from a script:
+// ./tap2meter -1 tap2midi
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tap2midi_meter.h"
+
+#define meter_floor_db (-60.0)
+#define meter_width (40)
+#define read_retries (1000) // Consistent copy of a device block within 0.1 s, or it is stale
+#define read_retry_ns (100000)
+
+const char *state_names[] = {"IDLE", "PEAK", "WAIT", "RISE", "DECAY"};
+#define state_count (sizeof(state_names) / sizeof(state_names[0]))
+
+// Seqlock reader, copy the block of device d and its channels, retry while they are rewritten
+// Returns -1 if the block stays inconsistent, e.g. tap2midi died while writing it
+int read_device(meter_segment *meter, int d, meter_device *md, meter_channel *mc){
+    meter_device *src = &meter->devices[d];
+    struct timespec pause = {0, read_retry_ns};
+    unsigned int seq;
+    int tries;
+    for (tries = 0; tries < read_retries; tries++){
+        if (tries) nanosleep(&pause, NULL);
+        if ((seq = atomic_load_explicit(&src->seq, memory_order_acquire)) & 1) continue;
+        md->first_channel = src->first_channel;
+        md->channels = src->channels;
+        md->sample_rate = src->sample_rate;
+        md->period_frames = src->period_frames;
+        md->periods = src->periods;
+        md->xruns = src->xruns;
+        md->frames_lost = src->frames_lost;
+        // Torn while tap2midi rewrote it, the copy would run past the channels
+        if (md->first_channel > meter->channel_count || md->channels > meter->channel_count - md->first_channel) continue;
+        memcpy(mc, &meter->channels[md->first_channel], md->channels * sizeof(meter_channel));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&src->seq, memory_order_relaxed) == seq) return 0;
+    }
+    return -1;
+}
+
+float to_db(float level){
+    return level > 0 ? 20 * log10f(level) : -INFINITY;
+}
+
+void print_bar(float level, float trigger){
+    int length = roundf((fmaxf(to_db(level), meter_floor_db) - meter_floor_db) * meter_width / -meter_floor_db);
+    int mark = roundf((fmaxf(to_db(trigger), meter_floor_db) - meter_floor_db) * meter_width / -meter_floor_db);
+    int i;
+    for (i = 0; i < meter_width; i++){
+        putchar(i == mark ? '|' : i < length ? '#' : '.');
+    }
+}
+
+void print_meters(meter_segment *meter, meter_channel *channels){
+    meter_device md;
+    meter_channel *mc;
+    int d, c;
+    for (d = 0; d < meter->device_count; d++){
+        if (read_device(meter, d, &md, channels) < 0){
+            printf("device %d: stale, tap2midi stopped while writing its meters\n", d);
+            continue;
+        }
+        printf("device %d: %u Hz, %u frames per buffer, %llu buffers, %u overruns, %lld frames lost\n",
+            d, md.sample_rate, md.period_frames, md.periods, md.xruns, md.frames_lost);
+        for (c = 0; c < md.channels; c++){
+            mc = &channels[c];
+            printf("%3d m%d %-5s %6.1f db ", md.first_channel + c, mc->method, (unsigned int)mc->state < state_count ? state_names[mc->state] : "?", fmaxf(to_db(mc->level), meter_floor_db));
+            print_bar(mc->level, mc->trigger);
+            printf(" envelope %6.1f db velocity %3d notes %u\n", fmaxf(to_db(mc->envelope), meter_floor_db), mc->velocity, mc->notes);
+        }
+    }
+}
+
+void usage(char *prog_name){
+    printf("Usage: %s [OPTION]... name\n\n", prog_name);
+    printf("Display the meters that tap2midi -O name publishes\n\n");
+    printf("-1          print the meters once and exit\n");
+    printf("-h          display this help message\n");
+    printf("-i time     refresh interval (ms), default 100\n");
+}
+
+int main (int argc, char *argv[])
+{
+    char *name = NULL;
+    int once = 0;
+    float interval_ms = 100;
+    char bidon;
+    int errcount = 0;
+    int arg, fd;
+    struct stat st;
+    struct timespec pause;
+    meter_segment *meter;
+    meter_channel *channels;
+    int clear = isatty(1);
+
+    for (arg = 1; arg < argc; arg++){
+        if (argv[arg][0] != '-'){
+            name = argv[arg];
+        }else if (!strcmp(argv[arg], "-h")){
+            usage(argv[0]);
+            exit(0);
+        }else if (!strcmp(argv[arg], "-1")){
+            once = 1;
+        }else if (!strcmp(argv[arg], "-i")){
+            if ((++arg)<argc){
+                if (sscanf(argv[arg], "%f%c", &interval_ms, &bidon) != 1 || interval_ms <= 0) {
+                    fprintf(stderr, "%s: not a positive float.\n", argv[arg]);
+                    errcount++;
+                }
+            }else{
+                fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                errcount++;
+            }
+        }else{
+            fprintf(stderr, "%s: unknown option.\n", argv[arg]);
+            errcount++;
+        }
+    }
+    if (errcount || !name){
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0){
+        fprintf (stderr, "cannot open shared memory %s (%s), is tap2midi -O %s running?\n", name, strerror(errno), name);
+        exit (1);
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(meter_segment)
+        || (meter = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        fprintf (stderr, "cannot map shared memory %s\n", name);
+        exit (1);
+    }
+    close(fd);
+    if (atomic_load_explicit(&meter->magic, memory_order_acquire) != meter_magic || meter->version != meter_version
+        || st.st_size < meter_segment_size(meter->channel_count)){
+        fprintf (stderr, "%s: not tap2midi meters of this version\n", name);
+        exit (1);
+    }
+    channels = calloc(meter->channel_count, sizeof(meter_channel));
+
+    pause.tv_sec = interval_ms / 1000;
+    pause.tv_nsec = (long)(interval_ms * 1e6) % 1000000000;
+    for (;;){
+        if (clear && !once) printf("\033[H\033[J");
+        print_meters(meter, channels);
+        fflush(stdout);
+        if (once) break;
+        if (!atomic_load(&meter->running)){
+            printf("tap2midi stopped\n");
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+    munmap(meter, st.st_size);
+    free(channels);
+    exit (0);
+}
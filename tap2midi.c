@@ -23,22 +23,38 @@
 // Includes code from http://equalarea.com/paul/alsa-audio.html Minimal Capture Program
 
 // Compile with:
-// gcc tap2midi.c -lasound -lm -o tap2midi
+// gcc -O2 tap2midi.c -lasound -lm -lpthread -o tap2midi
+// With JACK support (-j):
+// gcc -O2 -Djack tap2midi.c -lasound -ljack -lm -lpthread -o tap2midi
+// Meters published with -O are displayed by tap2meter.c, same directory
 
-// Use example (maybe a bit conservative):
+// Use example, method 1 (maybe a bit conservative):
 // wait time 8ms, trigger level -24 db
-// ./tap2midi -D hw:3,0 -d 0.98 -t 8 -l -24
+// ./tap2midi -D hw:3,0 -M 1 -d 0.98 -t 8 -l -24
 // A little more responsive:
 // -d 0.98 -t 0 -l -30
-// Method 2:
+// Method 2 (default):
 // ./tap2midi -D hw:2,0 -t 2 -w 25 -l -12
+// Compare methods on the same input, method 2 plays:
+// ./tap2midi -i take.wav -F -k 2,1,3 -t 2 -w 25 -l -24
 // NB - to identify your soundcard (hw:3,0 above), use
 // arecord -l
+// Replay a recorded take instead of the soundcard (add -F to run as fast as possible):
+// ./tap2midi -i take.wav -t 2 -w 25 -l -12
+// Raw files need format, rate and channel count:
+// ./tap2midi -i take.raw -s S16_LE -r 48000 -c 2 -F
+// How much of each buffer duration detection takes, per stage, printed at exit:
+// ./tap2midi -D hw:2,0 -b 32 -u
+// Change parameters while running, send commands such as "level 3 -36" or "help" to the socket:
+// ./tap2midi -D hw:2,0 -U /tmp/tap2midi.ctl
+// Record the audio around every hit in directory snapshots, to replay clips of false notes:
+// ./tap2midi -D hw:2,0 -t 2 -w 25 -l -12 -R snapshots
 
-// Currently hard-coded to S24_3LE sample format
+// Supports S24_3LE, S32_LE, S24_LE, S16_LE and FLOAT_LE sample formats,
+// the first one the sound input offers natively is used unless -s is given
 // int must be at least 32 bits
 
-// Method 1:
+// Method 1 (per input with -M):
 // Debouncing uses 2 different mechanisms, which can be combined:
 // - set a certain delay time before retriggering is allowed
 //   use parameter -t followed by milliseconds
@@ -50,16 +66,49 @@
 // When trigger level is reached, detect peak within t ms
 // After peak detection, wait for w ms before re-triggering is allowed
 
+// Method 3 (per input with -M):
+// Same as method 2, but the peak window starts at an onset found by the spectral flux
+// of the input, the trigger level is only a floor, so it can be set much lower
+// ./tap2midi -D hw:2,0 -M 3 -t 2 -w 25 -l -36
+
 // TODO list
 // flush stdout at every printf
 // OSC for individual audio channel parameters, including midi settings
 // Gui to send OSC messages, save and read file
 
+#define _GNU_SOURCE // CPU affinity
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <immintrin.h>
+#endif
 #include <alsa/asoundlib.h>
 #include <signal.h>
 #include <math.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#ifdef jack
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#endif
+#include "tap2midi_meter.h"
 
 
 
@@ -74,7 +123,10 @@
 
 // #define debug
 
-#define buf_frames (128)
+// Frames per buffer (ALSA period), set with -b
+// Timings given per buffer on the command line refer to buffers of this size
+#define reference_buf_frames (128)
+int buf_frames = reference_buf_frames;
 // #define channels (2)
 // #define channel_bytes (3)
 // #define frame_bytes (channels*channel_bytes)
@@ -83,260 +135,4470 @@
 static volatile int keepRunning = 1;
 
 int verbose = 0;
+atomic_long buffers_total = 0; // Buffers processed by all capture threads
 
 // See https://www.alsa-project.org/alsa-doc/alsa-lib/_2test_2rawmidi_8c-example.html
 snd_rawmidi_t *handle_out = 0;
+int midi_immediate = 0; // Write and drain each MIDI message on its own, see midi_flush()
 
 void intHandler(int dummy) {
     keepRunning = 0;
     fprintf (stderr, "Interrupted!\n");
 }
 
-void send_note_on(int channel, int note, int velocity){
+// Output thread
+// Capture threads never write to MIDI or to the terminal themselves, a blocking write
+// could delay the next capture read and cause an overrun. MIDI messages and log lines
+// go through a lock-free single producer, single consumer queue per capture thread to
+// the output thread, which merges them in time order.
+#define event_queue_size (1024) // Power of 2
+#define max_devices (8)
+
+typedef enum {
+    EVENT_MIDI,
+    EVENT_FLUSH, // End of period, send the MIDI messages collected so far
+    EVENT_LOG
+} EventType;
+
+typedef struct {
+    EventType type;
+    int length;
+    struct timespec time; // CLOCK_MONOTONIC capture time of the event, for the sequencer and for merging
+    struct timespec decided; // Capture time of the end of the buffer where the event was decided
+    int input; // Sound input channel of a MIDI event, -1 if none
+    unsigned char data[56]; // MIDI bytes or log text
+} out_event;
+
+typedef struct {
+    out_event events[event_queue_size];
+    atomic_uint head; // Next slot written by the capture thread
+    atomic_uint tail; // Next slot read by the output thread
+    unsigned int dropped; // Events lost because the queue was full
+    int wait_when_full; // Only when replaying a file as fast as possible
+    int midi_pending; // MIDI messages queued in the current buffer
+} event_queue;
+
+event_queue *event_queues[max_devices]; // One per capture thread
+int event_queue_count = 0;
+sem_t events_ready; // Posted for each event, sem_post never blocks
+atomic_int output_stop = 0; // No more events will come
+__thread event_queue *thread_queue = NULL; // Queue of the calling capture thread
+__thread struct timespec capture_time; // End of the buffer being processed by the calling capture thread
+
+// input is the sound input channel of a MIDI event, -1 if none
+int queue_event(EventType type, int input, const void *data, int length, struct timespec *time){
+    unsigned int head;
+    out_event *e;
+    event_queue *q = thread_queue;
+    struct timespec pause = {0, 100000};
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&q->tail, memory_order_acquire) >= event_queue_size){
+        if (!q->wait_when_full){
+            q->dropped++;
+            return -1;
+        }
+        nanosleep(&pause, NULL);
+    }
+    e = &q->events[head & (event_queue_size - 1)];
+    e->type = type;
+    e->time = time ? *time : capture_time;
+    e->decided = capture_time;
+    e->input = input;
+    e->length = min(length, (int)sizeof(e->data));
+    memcpy(e->data, data, e->length);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    sem_post(&events_ready);
+    return 0;
+}
+
+// printf-like logging from a capture thread, straight to stderr from other threads
+void log_event(const char *format, ...){
+    char text[sizeof(((out_event *)0)->data)];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (thread_queue){
+        queue_event(EVENT_LOG, -1, text, strlen(text) + 1, NULL);
+    }else{
+        fputs(text, stderr);
+    }
+}
+
+// Latency statistics
+// For each note on, the detection delay runs from the onset frame to the end of the buffer
+// where the note was decided (falling buffers of method 1, -t peak window of method 2), the
+// output delay from the onset frame to the write of the MIDI bytes, or to the time the
+// sequencer plays them. The output thread keeps 0.1 ms histograms per sound input channel,
+// dumped on SIGUSR1 and at exit.
+#define latency_bins (1024) // Last bin also counts longer delays
+#define latency_bin_ns (100000)
+
+typedef struct {
+    unsigned int bins[latency_bins];
+    unsigned int count;
+    long long max_ns;
+} latency_hist;
+
+latency_hist *detect_latency, *output_latency; // One per sound input channel
+int latency_channels = 0;
+volatile sig_atomic_t latency_dump_requested = 0;
+
+void latency_add(latency_hist *h, long long ns){
+    if (ns < 0) ns = 0;
+    h->bins[min(ns / latency_bin_ns, (long long)latency_bins - 1)]++;
+    h->count++;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+// Upper bound of the bin holding the given fraction of the delays, in ms
+float latency_percentile(latency_hist *h, float fraction){
+    unsigned int i, sum = 0;
+    for (i = 0; i < latency_bins - 1; i++){
+        sum += h->bins[i];
+        if (sum >= fraction * h->count) return min((i + 1) * latency_bin_ns, h->max_ns) / 1e6;
+    }
+    return h->max_ns / 1e6;
+}
+
+void print_latency(void){
+    int c;
+    latency_hist *d, *o;
+    fprintf(stderr, "latency after %ld buffers (ms)      detection p50/p99/max      output p50/p99/max    jitter\n", atomic_load(&buffers_total));
+    for (c = 0; c < latency_channels; c++){
+        d = &detect_latency[c];
+        o = &output_latency[c];
+        if (!o->count) continue;
+        fprintf(stderr, "channel %2d %6u notes  %7.2f %7.2f %7.2f   %7.2f %7.2f %7.2f   %7.2f\n", c, o->count,
+            latency_percentile(d, 0.5), latency_percentile(d, 0.99), d->max_ns / 1e6,
+            latency_percentile(o, 0.5), latency_percentile(o, 0.99), o->max_ns / 1e6,
+            latency_percentile(o, 0.99) - latency_percentile(o, 0.5));
+    }
+}
+
+void usr1Handler(int dummy) {
+    latency_dump_requested = 1;
+    sem_post(&events_ready); // Wake up output thread, sem_post is async-signal-safe
+}
+
+int is_note_on(out_event *e){
+    return e->input >= 0 && e->input < latency_channels && (e->data[0] & 0xF0) == 0x90 && e->data[2];
+}
+
+// Sequencer output
+// Notes are scheduled on a sequencer queue at their onset time plus a constant delay,
+// instead of being sent whenever their buffer happens to be processed. This removes
+// the jitter of up to one buffer that rawmidi output has.
+snd_seq_t *seq_handle = NULL;
+int seq_port, seq_queue;
+snd_midi_event_t *seq_encoder;
+struct timespec seq_start; // CLOCK_MONOTONIC time of queue start
+float seq_latency_ms = -1; // Onset to note delay, negative for rawmidi output
+unsigned int late_events = 0; // Could not be scheduled in time, sent immediately
+
+void timespec_add_ns(struct timespec *t, long long ns){
+    ns += t->tv_nsec;
+    t->tv_sec += ns / 1000000000LL;
+    t->tv_nsec = ns % 1000000000LL;
+    if (t->tv_nsec < 0){
+        t->tv_nsec += 1000000000L;
+        t->tv_sec--;
+    }
+}
+
+// Time of frame, counted from base, which may be negative
+void frame_time(struct timespec *t, struct timespec *base, long frames, unsigned int sample_rate){
+    *t = *base;
+    timespec_add_ns(t, frames * 1000000000LL / sample_rate);
+}
+
+long long timespec_diff_ns(struct timespec *t1, struct timespec *t0){
+    return (t1->tv_sec - t0->tv_sec) * 1000000000LL + (t1->tv_nsec - t0->tv_nsec);
+}
+
+int open_seq_output(void){
+    int err;
+    if ((err = snd_seq_open(&seq_handle, "default", SND_SEQ_OPEN_OUTPUT, 0)) < 0){
+        fprintf(stderr, "cannot open sequencer (%s)\n", snd_strerror(err));
+        return err;
+    }
+    snd_seq_set_client_name(seq_handle, "tap2midi");
+    if ((seq_port = snd_seq_create_simple_port(seq_handle, "tap2midi",
+            SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+            SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION)) < 0){
+        fprintf(stderr, "cannot create sequencer port (%s)\n", snd_strerror(seq_port));
+        return seq_port;
+    }
+    if ((seq_queue = snd_seq_alloc_named_queue(seq_handle, "tap2midi")) < 0){
+        fprintf(stderr, "cannot create sequencer queue (%s)\n", snd_strerror(seq_queue));
+        return seq_queue;
+    }
+    if ((err = snd_midi_event_new(16, &seq_encoder)) < 0){
+        fprintf(stderr, "cannot create MIDI event encoder (%s)\n", snd_strerror(err));
+        return err;
+    }
+    // Queue real time counts from here
+    snd_seq_start_queue(seq_handle, seq_queue, NULL);
+    snd_seq_drain_output(seq_handle);
+    clock_gettime(CLOCK_MONOTONIC, &seq_start);
+    printf("sequencer output, notes scheduled %g ms after onset\n", seq_latency_ms);
+    return 0;
+}
+
+void seq_write(out_event *e){
+    snd_seq_event_t ev;
+    snd_seq_real_time_t rt;
+    struct timespec now, due;
+    long long queue_ns;
+    snd_seq_ev_clear(&ev);
+    snd_midi_event_reset_encode(seq_encoder);
+    if (snd_midi_event_encode(seq_encoder, e->data, e->length, &ev) < e->length || ev.type == SND_SEQ_EVENT_NONE) return;
+    snd_seq_ev_set_source(&ev, seq_port);
+    snd_seq_ev_set_subs(&ev);
+    due = e->time;
+    timespec_add_ns(&due, (long long)(seq_latency_ms * 1e6));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_diff_ns(&due, &now) <= 0){
+        late_events++;
+        snd_seq_ev_set_direct(&ev);
+        due = now;
+    }else{
+        queue_ns = timespec_diff_ns(&due, &seq_start); // Queue time
+        rt.tv_sec = queue_ns / 1000000000LL;
+        rt.tv_nsec = queue_ns % 1000000000LL;
+        snd_seq_ev_schedule_real(&ev, seq_queue, 0, &rt);
+    }
+    if (is_note_on(e)){
+        latency_add(&output_latency[e->input], timespec_diff_ns(&due, &e->time));
+    }
+    if (midi_immediate){
+        snd_seq_event_output_direct(seq_handle, &ev);
+    }else{
+        snd_seq_event_output(seq_handle, &ev); // Sent by midi_flush
+    }
+}
+
+// MIDI messages of one period are collected and written at once, with running status:
+// one write and one drain per period instead of one per message, and 2 bytes instead
+// of 3 per message on the wire when several pads hit together.
+unsigned char midi_batch[1024];
+int midi_batch_length = 0;
+unsigned char running_status = 0; // Status byte of the last message in the batch
+struct {
+    int input;
+    struct timespec onset;
+} batch_notes[64]; // Note ons in the batch, their output delay is known once it is written
+int batch_note_count = 0;
+
+void midi_flush(void){
+    if (seq_handle){
+        snd_seq_drain_output(seq_handle);
+        return;
+    }
+    struct timespec now;
+    int i;
+    if (midi_batch_length){
+        snd_rawmidi_write(handle_out, midi_batch, midi_batch_length);
+        snd_rawmidi_drain(handle_out);
+        midi_batch_length = 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (i = 0; i < batch_note_count; i++){
+            latency_add(&output_latency[batch_notes[i].input], timespec_diff_ns(&now, &batch_notes[i].onset));
+        }
+        batch_note_count = 0;
+    }
+    running_status = 0; // Next batch starts with a full message, receivers may have missed a byte
+}
+
+void midi_write(out_event *e){
+    unsigned char *ch = e->data;
+    int length = e->length;
+    struct timespec now;
+    if (verbose){
+        if ((ch[0] & 0xF0) == 0xA0){
+            fprintf(stderr, "\nMIDI aftertouch %x %x %x ", (unsigned int)ch[0], (unsigned int)ch[1], (unsigned int)ch[2]);
+        }else if (ch[2]){
+            fprintf(stderr, "\nMIDI note on %x %x %x ", (unsigned int)ch[0], (unsigned int)ch[1], (unsigned int)ch[2]);
+        }else{
+            fprintf(stderr, "\nMIDI note off %x %x ", (unsigned int)ch[0], (unsigned int)ch[1]);
+        }
+    }
+    if (is_note_on(e)){
+        latency_add(&detect_latency[e->input], timespec_diff_ns(&e->decided, &e->time));
+    }
+    if (seq_handle){
+        seq_write(e);
+        return;
+    }
+    if (midi_immediate){
+        snd_rawmidi_write(handle_out, ch, length);
+        //~ snd_rawmidi_write(handle_out, &ch[0], 1);
+        //~ snd_rawmidi_write(handle_out, &ch[1], 1);
+        //~ snd_rawmidi_write(handle_out, &ch[2], 1);
+        snd_rawmidi_drain(handle_out); // Not always effective??
+        if (is_note_on(e)){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            latency_add(&output_latency[e->input], timespec_diff_ns(&now, &e->time));
+        }
+        return;
+    }
+    if (midi_batch_length + length > sizeof(midi_batch) || batch_note_count == sizeof(batch_notes) / sizeof(batch_notes[0])){
+        midi_flush();
+    }
+    if (is_note_on(e)){
+        batch_notes[batch_note_count].input = e->input;
+        batch_notes[batch_note_count].onset = e->time;
+        batch_note_count++;
+    }
+    if (ch[0] == running_status){ // Same status as previous message, skip it
+        ch++;
+        length--;
+    }else{
+        running_status = ch[0];
+    }
+    memcpy(midi_batch + midi_batch_length, ch, length);
+    midi_batch_length += length;
+}
+
+// Queue whose next event is the oldest, NULL if all are empty
+event_queue *oldest_queue(void){
+    event_queue *q, *oldest = NULL;
+    out_event *e, *oldest_event = NULL;
+    unsigned int tail;
+    int i;
+    for (i = 0; i < event_queue_count; i++){
+        q = event_queues[i];
+        tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        if (tail == atomic_load_explicit(&q->head, memory_order_acquire)) continue;
+        e = &q->events[tail & (event_queue_size - 1)];
+        if (!oldest || timespec_diff_ns(&e->time, &oldest_event->time) < 0){
+            oldest = q;
+            oldest_event = e;
+        }
+    }
+    return oldest;
+}
+
+void *output_thread(void *arg){
+    out_event *e;
+    event_queue *q;
+    unsigned int tail;
+    while (1){
+        while (sem_wait(&events_ready) && (errno == EINTR));
+        if (latency_dump_requested){
+            latency_dump_requested = 0;
+            print_latency();
+        }
+        if ((q = oldest_queue()) == NULL){
+            if (atomic_load(&output_stop)) break;
+            continue;
+        }
+        tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        e = &q->events[tail & (event_queue_size - 1)];
+        switch (e->type){
+            case EVENT_MIDI:
+                midi_write(e);
+                break;
+            case EVENT_FLUSH:
+                midi_flush();
+                break;
+            case EVENT_LOG:
+                fputs((char *)e->data, stderr);
+                break;
+        }
+        atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    }
+    midi_flush();
+    return NULL;
+}
+
+// Real-time scheduling for the calling thread, priority 0 leaves it alone
+void set_realtime(char *name, int priority, int cpu){
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err;
+    if (priority > 0){
+        param.sched_priority = priority;
+        if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))){
+            fprintf (stderr, "cannot set %s thread to SCHED_FIFO priority %d (%s)\n", name, priority, strerror(err));
+        }else{
+            fprintf (stderr, "%s thread set to SCHED_FIFO priority %d\n", name, priority);
+        }
+    }
+    if (cpu >= 0){
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))){
+            fprintf (stderr, "cannot pin %s thread to CPU %d (%s)\n", name, cpu, strerror(err));
+        }else{
+            fprintf (stderr, "%s thread pinned to CPU %d\n", name, cpu);
+        }
+    }
+}
+
+int rt_priority = 70; // Audio thread, output thread runs one below
+
+void *output_thread_start(void *arg){
+    set_realtime("output", rt_priority > 1 ? rt_priority - 1 : 0, -1);
+    return output_thread(arg);
+}
+
+// End of period: have the output thread send the messages of this period in one go
+#ifdef jack
+// JACK MIDI output
+// In JACK mode the detectors run in the process callback and their notes go straight to
+// the MIDI port buffer of the same cycle, at the frame offset of their time in the input
+// buffer: every note plays exactly one period after its sound, without jitter.
+jack_client_t *jack_client = NULL;
+jack_port_t *jack_midi_port = NULL;
+__thread void *jack_midi_buffer = NULL; // MIDI port buffer of the current cycle, process thread only
+__thread struct timespec jack_buffer_start; // Capture time of the first frame of the current cycle
+__thread jack_nframes_t jack_offset; // Offset of the last event, JACK wants them in order
+unsigned int jack_rate;
+unsigned int jack_dropped = 0; // MIDI port buffer full
+
+void jack_midi_send(int input, unsigned char *msg, int length, struct timespec *time){
+    struct timespec out_time;
+    long long offset;
+    offset = timespec_diff_ns(time, &jack_buffer_start) * jack_rate / 1000000000LL;
+    jack_offset = max(jack_offset, (jack_nframes_t)min(max(offset, 0LL), (long long)buf_frames - 1));
+    if (jack_midi_event_write(jack_midi_buffer, jack_offset, msg, length)){
+        jack_dropped++;
+        return;
+    }
+    if (input >= 0 && input < latency_channels && (msg[0] & 0xF0) == 0x90 && msg[2]){
+        latency_add(&detect_latency[input], timespec_diff_ns(&capture_time, time));
+        // Played one period later
+        frame_time(&out_time, &capture_time, jack_offset, jack_rate);
+        latency_add(&output_latency[input], timespec_diff_ns(&out_time, time));
+    }
+    if (verbose){
+        log_event("\nMIDI %x %x %x at %u ", (unsigned int)msg[0], (unsigned int)msg[1], (unsigned int)msg[2], jack_offset);
+    }
+}
+#endif
+
+// MIDI message from a capture thread, through its queue to the output thread
+void send_midi(int input, unsigned char *msg, int length, struct timespec *time){
+#ifdef jack
+    if (jack_midi_buffer){
+        jack_midi_send(input, msg, length, time);
+        return;
+    }
+#endif
+    if (!queue_event(EVENT_MIDI, input, msg, length, time)) thread_queue->midi_pending = 1;
+}
+
+void send_midi_batch(void){
+    if (thread_queue->midi_pending && !midi_immediate){
+        queue_event(EVENT_FLUSH, -1, NULL, 0, NULL);
+    }
+    thread_queue->midi_pending = 0;
+}
+
+void send_note_on(int input, int channel, int note, int velocity, struct timespec *time){
     // send midi note on or off message
     // velocity = 0 means note off
+    // input is the sound input channel, time is when the sound that caused it was captured
     unsigned char ch[3];
     ch[0] = 0x90 + (channel & 0x0F);
     ch[1] = note & 0x7F;
     ch[2] = velocity & 0x7F;
-    if (verbose){
-        if (ch[2]){
-            fprintf(stderr, "\nMIDI note on %x %x %x ", (unsigned int)ch[0], (unsigned int)ch[1], (unsigned int)ch[2]);
-        }else{
-            fprintf(stderr, "\nMIDI note off %x %x ", (unsigned int)ch[0], (unsigned int)ch[1]);
+    send_midi(input, ch, 3, time);
+}
+
+void send_note_off(int input, int channel, int note, struct timespec *time){
+    send_note_on(input, channel, note, 0, time);
+}
+
+void send_aftertouch(int input, int channel, int note, int pressure, struct timespec *time){
+    // send midi polyphonic key pressure, corrects the velocity of a note sent early
+    unsigned char ch[3];
+    ch[0] = 0xA0 + (channel & 0x0F);
+    ch[1] = note & 0x7F;
+    ch[2] = pressure & 0x7F;
+    send_midi(input, ch, 3, time);
+}
+
+// Timers
+// Note-offs and the end of retrigger inhibit are due at exact frame positions of the input
+// stream, whatever the buffer size. They sit in a hashed timer wheel with one slot per
+// buffer: each buffer only looks at its own slot, so it costs nothing when nothing is due.
+#define wheel_slots (256) // Power of 2, timers further away stay in their slot for more turns
+
+typedef enum {
+    TIMER_NOTE_OFF,
+    TIMER_RETRIGGER // End of retrigger inhibit, method 2
+} TimerType;
+
+typedef struct timer {
+    struct timer *next, **prev; // In wheel slot, prev is NULL when not scheduled
+    long long due; // Frame position in input stream
+    long long slot_pos; // Due, or the next buffer if due is already past
+    TimerType type;
+    int channel;
+} timer;
+
+typedef struct {
+    timer *slots[wheel_slots];
+    long long now; // End of the last expired buffer
+} timer_wheel;
+
+void timer_init(timer *t, TimerType type, int channel){
+    t->next = NULL;
+    t->prev = NULL;
+    t->type = type;
+    t->channel = channel;
+}
+
+int timer_pending(timer *t){
+    return t->prev != NULL;
+}
+
+void timer_cancel(timer *t){
+    if (t->prev){
+        *t->prev = t->next;
+        if (t->next) t->next->prev = t->prev;
+        t->prev = NULL;
+    }
+}
+
+void timer_schedule(timer_wheel *w, timer *t, long long due){
+    timer **slot;
+    timer_cancel(t);
+    t->due = due;
+    t->slot_pos = max(due, w->now);
+    slot = &w->slots[(t->slot_pos / buf_frames) & (wheel_slots - 1)];
+    t->next = *slot;
+    if (t->next) t->next->prev = &t->next;
+    t->prev = slot;
+    *slot = t;
+}
+
+// Unlink and return the timers due before end, the end of the current buffer.
+// Must be called once per buffer; after a gap in the input it also visits the slots
+// of the missing buffers. The returned list is linked through next.
+timer *timer_expire(timer_wheel *w, long long end){
+    timer *t, *next, *expired = NULL;
+    long long b, first = w->now / buf_frames, last = (end - 1) / buf_frames;
+    if (last - first >= wheel_slots) first = last - wheel_slots + 1; // Each slot once
+    for (b = first; b <= last; b++){
+        for (t = w->slots[b & (wheel_slots - 1)]; t; t = next){
+            next = t->next;
+            if (t->slot_pos < end){ // Not one turn later
+                timer_cancel(t);
+                t->next = expired;
+                expired = t;
+            }
         }
     }
-    snd_rawmidi_write(handle_out, ch, 3);
-    //~ snd_rawmidi_write(handle_out, &ch[0], 1);
-    //~ snd_rawmidi_write(handle_out, &ch[1], 1);
-    //~ snd_rawmidi_write(handle_out, &ch[2], 1);
-    snd_rawmidi_drain(handle_out); // Not always effective??
+    w->now = end;
+    return expired;
+}
+
+
+// Sample readers
+// Formats wider than 24 bits are scaled down to 24 bits, so abs() cannot overflow
+// and the detectors see the same level range as with S24_3LE
+static inline int read_S16_LE(unsigned char *p){
+    return *(short int *)p;
 }
 
-void send_note_off(int channel, int note){
-    send_note_on(channel, note, 0);
+static inline int read_S24_3LE(unsigned char *p){
+    // Assemble in the 3 MSB then shift back, sign-extends without branching
+    return (int)((unsigned int)p[0]<<8 | (unsigned int)p[1]<<16 | (unsigned int)p[2]<<24) >> 8;
 }
 
-void (*f)(int channel_count, char *buf2, int *max_l, int *previous_max_l, int *previous_max_v);
+static inline int read_S24_LE(unsigned char *p){
+    return (int)(*(unsigned int *)p << 8) >> 8; // Upper byte is padding
+}
 
-void find_peak_S16_LE(int channel_count, char *buf, int *max_l, int *previous_max_l, int *previous_max_v){
-    // The following section is hard-coded to S16_LE
-    // Look for peak
-    int c;
+static inline int read_S32_LE(unsigned char *p){
+    return *(int *)p >> 8;
+}
+
+static inline int read_FLOAT_LE(unsigned char *p){
+    float x = *(float *)p;
+    // Clip overs, plain compares so they compile to min/max instructions
+    // NaN fails every compare, it is silence rather than full scale
+    x = (x == x) ? x : 0.0f;
+    x = (x < 1.0f) ? x : 1.0f;
+    x = (x > -1.0f) ? x : -1.0f;
+    return (int)(x * 0x7FFFFF);
+}
+
+// Kernels are generated for each sample format, once with a run-time channel count
+// and once for each common channel count. With a constant channel count the compiler
+// unrolls the channel loop and the frame stride is a constant, so the inner loops
+// have neither indirect calls nor stride arithmetic.
+#define FORMAT_KERNELS(format, bytes, velocity_shift) \
+static inline __attribute__((always_inline)) \
+void find_peak_##format##_body(int channel_count, unsigned char *buf, int frame_count, int *max_l, int *previous_max_l, int *previous_max_v){ \
+    /* Look for peak */ \
+    int c, frame, l; \
+    for(c = 0; c < channel_count; c++){ \
+        /* 7 MSB; -1 in case previous_max_l is 0x800000 (abs(-0x800000)) */ \
+        previous_max_v[c] = (previous_max_l[c]-1) >> velocity_shift; \
+    } \
+    for(frame = 0; frame < frame_count; frame++){ \
+        for(c = 0; c < channel_count; c++){ \
+            l = abs(read_##format(buf)); \
+            if (l > max_l[c]){ \
+                max_l[c] = l; \
+            } \
+            buf += bytes; \
+        } \
+    } \
+} \
+static inline __attribute__((always_inline)) \
+void deinterleave_##format##_body(int channel_count, unsigned char *buf, int frame_count, int *planes, int plane_stride, int *plane_peak){ \
+    int frame, c, s; \
+    for(frame = 0; frame < frame_count; frame++){ \
+        for(c = 0; c < channel_count; c++){ \
+            s = read_##format(buf); \
+            planes[c * plane_stride + frame] = s; \
+            /* Buffer peak, lets silent channels skip their scan */ \
+            if (abs(s) > plane_peak[c]) plane_peak[c] = abs(s); \
+            buf += bytes; \
+        } \
+    } \
+} \
+void find_peak_##format(int channel_count, unsigned char *buf, int frame_count, int *max_l, int *previous_max_l, int *previous_max_v){ \
+    find_peak_##format##_body(channel_count, buf, frame_count, max_l, previous_max_l, previous_max_v); \
+} \
+void deinterleave_##format(int channel_count, unsigned char *buf, int frame_count, int *planes, int plane_stride, int *plane_peak){ \
+    deinterleave_##format##_body(channel_count, buf, frame_count, planes, plane_stride, plane_peak); \
+} \
+SPECIALISE(format, 1) SPECIALISE(format, 2) SPECIALISE(format, 4) SPECIALISE(format, 6) \
+SPECIALISE(format, 8) SPECIALISE(format, 10) SPECIALISE(format, 16) SPECIALISE(format, 32) \
+SPECIALISE(format, 64) SPECIALISE(format, 128) \
+format_kernels format##_kernels[] = { \
+    KERNELS(format, 1), KERNELS(format, 2), KERNELS(format, 4), KERNELS(format, 6), \
+    KERNELS(format, 8), KERNELS(format, 10), KERNELS(format, 16), KERNELS(format, 32), \
+    KERNELS(format, 64), KERNELS(format, 128), \
+    {0, find_peak_##format, deinterleave_##format} /* Any other channel count */ \
+};
+
+#define SPECIALISE(format, n) \
+void find_peak_##format##_##n(int channel_count, unsigned char *buf, int frame_count, int *max_l, int *previous_max_l, int *previous_max_v){ \
+    find_peak_##format##_body(n, buf, frame_count, max_l, previous_max_l, previous_max_v); \
+} \
+void deinterleave_##format##_##n(int channel_count, unsigned char *buf, int frame_count, int *planes, int plane_stride, int *plane_peak){ \
+    deinterleave_##format##_body(n, buf, frame_count, planes, plane_stride, plane_peak); \
+}
+
+#define KERNELS(format, n) {n, find_peak_##format##_##n, deinterleave_##format##_##n}
+
+typedef struct {
+    int channel_count; // 0 for any channel count
+    void (*find_peak)(int channel_count, unsigned char *buf, int frame_count, int *max_l, int *previous_max_l, int *previous_max_v);
+    void (*deinterleave)(int channel_count, unsigned char *buf, int frame_count, int *planes, int plane_stride, int *plane_peak);
+} format_kernels;
+
+FORMAT_KERNELS(S16_LE, 2, 8)
+FORMAT_KERNELS(S24_3LE, 3, 16)
+FORMAT_KERNELS(S24_LE, 4, 16)
+FORMAT_KERNELS(S32_LE, 4, 16)
+FORMAT_KERNELS(FLOAT_LE, 4, 16)
+
+// Vectorised S24_3LE peak search
+// Interleaved samples are scanned as one flat stream, sample n belongs to channel n % channel_count.
+// Lane k of the accumulator vector j sees samples n = j * lanes + k modulo lcm(channel_count, lanes),
+// which is a multiple of channel_count, so each accumulator lane always holds the same channel.
+// Lanes are folded into max_l at the end, results are identical to find_peak_S24_3LE.
+int gcd(int a, int b){
+    while (b){
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+void find_peak_S24_3LE_tail(int channel_count, unsigned char *buf, int n, int samples, int *max_l){
+    int a;
+    for(; n < samples; n++){
+        a = abs(read_S24_3LE(buf + 3*n));
+        if (a > max_l[n % channel_count]) max_l[n % channel_count] = a;
+    }
+}
+
+void fold_lanes(int channel_count, int *lanes, int lane_count, int *max_l){
+    int k, c;
+    for(k = 0; k < lane_count; k++){
+        c = k % channel_count;
+        if (lanes[k] > max_l[c]) max_l[c] = lanes[k];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.1")))
+void find_peak_S24_3LE_sse41(int channel_count, unsigned char *buf, int frame_count, int *max_l, int *previous_max_l, int *previous_max_v){
+    int c, n, j, samples, vectors;
     for(c = 0; c < channel_count; c++){
-        previous_max_v[c] = (previous_max_l[c]-1) >> 8; // 16-bit specific
-        // 7 MSB; -1 in case previous_max_l is 0x8000000 (abs(-0x8000000)));
+        previous_max_v[c] = (previous_max_l[c]-1) >> 16; // 24-bit specific
     }
-    int frame;
-    for(frame = 0; frame < buf_frames; frame++){
-        for(c = 0; c < channel_count; c++){
-            int l, a, d;
-            //~ a = buf[byte_offset] | buf[byte_offset+1]<<8 | buf[byte_offset+2]<<16; // Unsigned
-            a = ((short int*)buf)[0]; // buf[0] | buf[1]<<8;
-            l = abs(a);
-            //~ d = abs(a - previous[c]);
-            //~ previous[c] = a;
-            if (l > max_l[c]){
-                max_l[c] = l;
-            }
-            //~ if (d > max_d[c]){ // Max diff ~ slope - should help predicting hit strength ?
-                //~ max_d[c] = d;
-            //~ }
-            buf += 2; //channel_bytes; // byte_offset = frame_bytes * frame + channel_bytes * c;
-        }
+    samples = frame_count * channel_count;
+    vectors = channel_count / gcd(channel_count, 4); // lcm(channel_count, 4) / 4
+    __m128i acc[vectors];
+    int lanes[vectors * 4];
+    // Move each 3-byte sample to the 3 MSB of a 32-bit lane, 0x80 clears the LSB
+    const __m128i shuffle = _mm_setr_epi8(0x80,0,1,2, 0x80,3,4,5, 0x80,6,7,8, 0x80,9,10,11);
+    for(j = 0; j < vectors; j++) acc[j] = _mm_setzero_si128();
+    j = 0;
+    // 4 samples from 12 bytes, but loads are 16 bytes wide
+    for(n = 0; n + 6 <= samples; n += 4){
+        __m128i v = _mm_loadu_si128((__m128i *)(buf + 3*n));
+        v = _mm_shuffle_epi8(v, shuffle);
+        v = _mm_abs_epi32(_mm_srai_epi32(v, 8)); // Sign-extend, abs
+        acc[j] = _mm_max_epi32(acc[j], v);
+        if (++j == vectors) j = 0;
     }
+    for(j = 0; j < vectors; j++) _mm_storeu_si128((__m128i *)&lanes[4*j], acc[j]);
+    fold_lanes(channel_count, lanes, vectors * 4, max_l);
+    find_peak_S24_3LE_tail(channel_count, buf, n, samples, max_l);
 }
 
-void find_peak_S24_3LE(int channel_count, char *buf, int *max_l, int *previous_max_l, int *previous_max_v){
-    // The following section is hard-coded to S24_3LE
-    // Look for peak
-    int c;
+__attribute__((target("avx2")))
+void find_peak_S24_3LE_avx2(int channel_count, unsigned char *buf, int frame_count, int *max_l, int *previous_max_l, int *previous_max_v){
+    int c, n, j, samples, vectors;
     for(c = 0; c < channel_count; c++){
         previous_max_v[c] = (previous_max_l[c]-1) >> 16; // 24-bit specific
-        // 7 MSB; -1 in case previous_max_l is 0x8000000 (abs(-0x8000000)));
     }
-    int frame;
-    for(frame = 0; frame < buf_frames; frame++){
-        for(c = 0; c < channel_count; c++){
-            int l, a, d;
-            //~ a = buf[byte_offset] | buf[byte_offset+1]<<8 | buf[byte_offset+2]<<16; // Unsigned
-            a = buf[0] | buf[1]<<8 | buf[2]<<16; // Unsigned
-            l = a;
-            if (a > 0x7FFFFF){ // Sample is negative
-                a = a-0x1000000; // Get signed amplitude, -800000..-1
-                l = -a; // abs, 1..800000
-            }
-            //~ d = abs(a - previous[c]);
-            //~ previous[c] = a;
-            if (l > max_l[c]){
-                max_l[c] = l;
-            }
-            //~ if (d > max_d[c]){ // Max diff ~ slope - should help predicting hit strength ?
-                //~ max_d[c] = d;
-            //~ }
-            buf += 3; // channel_bytes; // byte_offset = frame_bytes * frame + channel_bytes * c;
-        }
+    samples = frame_count * channel_count;
+    vectors = channel_count / gcd(channel_count, 8); // lcm(channel_count, 8) / 8
+    __m256i acc[vectors];
+    int lanes[vectors * 8];
+    const __m256i shuffle = _mm256_setr_epi8(0x80,0,1,2, 0x80,3,4,5, 0x80,6,7,8, 0x80,9,10,11,
+                                             0x80,0,1,2, 0x80,3,4,5, 0x80,6,7,8, 0x80,9,10,11);
+    for(j = 0; j < vectors; j++) acc[j] = _mm256_setzero_si256();
+    j = 0;
+    // 8 samples from 24 bytes, as two 16-byte loads at offsets 0 and 12
+    for(n = 0; n + 10 <= samples; n += 8){
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((__m128i *)(buf + 3*n))),
+            _mm_loadu_si128((__m128i *)(buf + 3*n + 12)), 1);
+        v = _mm256_shuffle_epi8(v, shuffle);
+        v = _mm256_abs_epi32(_mm256_srai_epi32(v, 8));
+        acc[j] = _mm256_max_epi32(acc[j], v);
+        if (++j == vectors) j = 0;
     }
+    for(j = 0; j < vectors; j++) _mm256_storeu_si256((__m256i *)&lanes[8*j], acc[j]);
+    fold_lanes(channel_count, lanes, vectors * 8, max_l);
+    find_peak_S24_3LE_tail(channel_count, buf, n, samples, max_l);
+}
+#endif
+
+// Best S24_3LE peak kernel for this CPU, or the given scalar kernel
+// Elsewhere (e.g. ARM) the branchless scalar loop is left to the compiler's auto-vectoriser
+void (*select_find_peak_S24_3LE(void (*scalar)(int, unsigned char *, int, int *, int *, int *)))(int, unsigned char *, int, int *, int *, int *){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return find_peak_S24_3LE_avx2;
+    if (__builtin_cpu_supports("sse4.1")) return find_peak_S24_3LE_sse41;
+#endif
+    return scalar;
 }
 
 // Method 2 helper functions
-int (*f_peak)(int channel_count, char *buf, int frame_count, int channel, int *peak);
+// Each buffer is deinterleaved once into planar 32-bit samples, one cache-aligned
+// array per channel, so the per-channel state machines scan contiguous memory
+// instead of striding through the interleaved buffer once per channel.
+#define plane_align (16) // Samples per 64-byte cache line
 
-int find_channel_peak_S16_LE(int channel_count, char *buf, int frame_count, int channel, int *peak){
-    int frame, peak_frame;
-    peak_frame=-1;
-    int a;
-    for(frame = 0; frame < frame_count; frame++){
-		a=abs(((short int*)buf)[frame * channel_count + channel]);
-		if (a > *peak){
-			*peak=a;
-			peak_frame=frame;
-		}
-	}
-	return(peak_frame);
+// Distance between planes, an odd number of cache lines: with a power of two the planes
+// of a 64-input card all map to the same cache sets and evict each other while written
+int plane_stride_for(int frame_count){
+    int stride = (frame_count + plane_align - 1) & ~(plane_align - 1);
+    if ((stride / plane_align) % 2 == 0) stride += plane_align;
+    return stride;
 }
- 
-int find_channel_peak_S24_3LE(int channel_count, char *buf, int frame_count, int channel, int *peak){
-    int frame, frame_bytes, peak_frame;
-    int a;
-    frame_bytes = 3 * channel_count;
+
+int find_channel_peak(int *samples, int frame_count, int *peak){
+    int frame, peak_frame;
+    int a, p;
     peak_frame=-1;
+    p = *peak; // Local copy, the store through peak would otherwise happen every frame
     for(frame = 0; frame < frame_count; frame++){
-		a = buf[channel] | buf[channel+1]<<8 | buf[channel+2]<<16; // Unsigned)
-		if (a > 0x7FFFFF){ // Sample is negative
-			a = 0x1000000 - a ; // abs		
-		}
-		if (a > *peak){
-			*peak=a;
+		a=abs(samples[frame]);
+		if (a > p){
+			p=a;
 			peak_frame=frame;
 		}
-		buf += frame_bytes;
 	}
+	*peak = p;
 	return(peak_frame);
 }
 
-int (*f_trig)(int channel_count, char *buf, int frame_count, int channel, int trig_lvl);
+// MIDI velocity 1..127 of a peak level between trigger level and full scale
+int peak_velocity(int peak, int trig_lvl, int max_sample_value){
+    return 1+126*(min(peak, max_sample_value)-trig_lvl)/(max_sample_value-trig_lvl);
+}
 
-int find_channel_trig_S16_LE(int channel_count, char *buf, int frame_count, int channel, int trig_lvl){
+int find_channel_trig(int *samples, int frame_count, int trig_lvl){
     int frame;
-    int a;
     for(frame = 0; frame < frame_count; frame++){
-		a=abs(((short int*)buf)[frame * channel_count + channel]);
-		if (a>trig_lvl) return frame;
+		if (abs(samples[frame])>trig_lvl) return frame;
 	}
 	return(-1);
 }
- 
-int find_channel_trig_S24_3LE(int channel_count, char *buf, int frame_count, int channel, int trig_lvl){
-    int frame, frame_bytes;
-    int peak = 0;
-    int a, l;
-    frame_bytes = 3 * channel_count;
-    for(frame = 0; frame < frame_count; frame++){
-		a = buf[channel] | buf[channel+1]<<8 | buf[channel+2]<<16; // Unsigned)
-		if (a > 0x7FFFFF){ // Sample is negative
-			a = 0x1000000 - a ; // abs		
-		}
-		if (a>trig_lvl) return frame;
-		buf += frame_bytes;
-	}
-	return(-1);
+
+// Method 3 helper functions
+// Streaming spectral flux: every flux_hop frames the last flux_size frames of a channel go
+// through a Hann window and an FFT, and the rise of every bin magnitude since the previous
+// hop is summed, weighted by frequency (high frequency content). A tap is broadband and
+// abrupt, it stands out from hum, bleed and slow swells that an amplitude trigger level
+// has to be set above. Onset resolution is one hop, 0.7 ms at 48 kHz.
+#define flux_size (64) // FFT size
+#define flux_hop (32) // Frames between FFTs
+#define flux_bins (flux_size / 2 + 1)
+#define flux_mean_ms (50.0) // Time constant of the running flux average
+#define flux_max_frames (64 * flux_hop) // Longest buffer, one bit per hop in the onset mask
+
+float flux_window[flux_size];
+float flux_cos[flux_size / 2], flux_sin[flux_size / 2];
+int flux_bitrev[flux_size];
+float flux_ratio = 4.0; // An onset needs this times the running average
+
+void flux_init(void){
+    int i, j, b;
+    for (i = 0; i < flux_size; i++){
+        flux_window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / flux_size);
+        for (j = 0, b = 1; b < flux_size; b <<= 1){
+            j = (j << 1) | ((i & b) != 0);
+        }
+        flux_bitrev[i] = j;
+    }
+    for (i = 0; i < flux_size / 2; i++){
+        flux_cos[i] = cos(2 * M_PI * i / flux_size);
+        flux_sin[i] = -sin(2 * M_PI * i / flux_size);
+    }
 }
 
-void usage(char *prog_name){
-    printf("Usage: %s [OPTION]...\n\n", prog_name);
-    printf("-c channels channel count\n");
-    printf("-d rate     envelope decay rate (per buffer)\n");
-    printf("            typically 0.97..0.99, higher values mean more anti-bouncing\n");
-    printf("-D device   alsa sound input device\n");
-    printf("-f          faster slope detection (may cause double-triggering)\n");
-    printf("-g factor   initial gain of envelope (db)\n");
-    printf("            typically 0, higher values mean more anti-bouncing\n");
-    printf("-h          display this help message\n");
-    printf("-l level    trigger level (db, must be negative)\n");
-    printf("            typically -36..-24, more negative values mean more sensitivity\n");
-    printf("-r rate     sample rate (Hz)\n");
-    printf("-t time     trigger delay time (ms)\n");
-    printf("-w time     retrigger wait delay time for anti-bouncing (ms)\n");
-    printf("-v          verbose\n");
-    printf("-x time     note off (extinction) delay time (ms)\n");
-    printf("-X          force note off (extinction) before new note\n");
+// In place radix-2 FFT, input in bit-reversed order
+void flux_fft(float *re, float *im){
+    int size, half, step, i, j, k;
+    float tr, ti;
+    for (size = 2; size <= flux_size; size <<= 1){
+        half = size / 2;
+        step = flux_size / size;
+        for (i = 0; i < flux_size; i += size){
+            for (j = 0; j < half; j++){
+                k = i + j;
+                tr = re[k + half] * flux_cos[j * step] - im[k + half] * flux_sin[j * step];
+                ti = re[k + half] * flux_sin[j * step] + im[k + half] * flux_cos[j * step];
+                re[k + half] = re[k] - tr;
+                im[k + half] = im[k] - ti;
+                re[k] += tr;
+                im[k] += ti;
+            }
+        }
+    }
 }
 
-int main (int argc, char *argv[])
-{
-    int i;
-    int err;
-    int errcount=0;
-    char *device_name = "default";
-    int sample_rate = 44100; // Will be updated by ALSA
-    int channels = 2, channel_bytes, frame_bytes, buf_bytes;
-    int max_sample_value = 0x7FFFFF; // 24SE -> 3 bytes per sample
-    unsigned char* buf; //[buf_bytes];
-    char bidon;
-    snd_pcm_t *capture_handle;
-    snd_pcm_hw_params_t *hw_params;
-    float trig_delay_ms = 0, wait_delay_ms = 0;
-    int trig_delay_frames_default, trig_delay_buffers_default;
-    int wait_delay_frames_default, wait_delay_buffers_default;
-    float decay_rate_default = 0.98;
-    float decay_factor_default;
-    float decay_factor_db = 6.0;
-    float trigger_level_db = -30.0; // full range 0x7FFFFF / 0x7FFF = 256 ==> -48db = -6 * ln(256)/ln(2)
-    float max_note_off_delay_ms = 250.0;
-    int force_note_off = 0;
-    int single_buffer = 0;
-    int trig_level_default;
-    // ln(q)=G * ln(2)/-6 ==> q = exp(G * ln(2)/-6)
+// Flux of the window in history, the magnitudes of the previous hop in mag are replaced
+// Scaled to sample units: a sine of amplitude A gives a bin magnitude of A * flux_size / 4
+float flux_of_hop(float *history, float *mag){
+    float re[flux_size], im[flux_size];
+    float m, flux = 0;
+    int i, k;
+    for (i = 0; i < flux_size; i++){
+        re[flux_bitrev[i]] = history[i] * flux_window[i];
+        im[i] = 0;
+    }
+    flux_fft(re, im);
+    for (k = 1; k < flux_bins; k++){
+        m = sqrtf(re[k] * re[k] + im[k] * im[k]);
+        if (m > mag[k]) flux += k * (m - mag[k]);
+        mag[k] = m;
+    }
+    return flux * 4 / flux_size / (flux_bins - 1);
+}
 
-    // Handle command-line arguments
-    int arg = 1;
-    //~ if (argc>1){
-        //~ device_name = argv[1];
-        //~ arg++;
-    //~ }
-    while(arg<argc){
-        // printf("%s\n", argv[arg]);
-        if (argv[arg][0]!='-'){
-            fprintf(stderr, "%s: not an option.\n", argv[arg]);
-            errcount++;
-        }else{ // Found dash, we know [1] is not past end of string
-            if ( argv[arg][1] && (argv[arg][2] == 0)){ // Length is ok
-                switch(argv[arg][1]){
-                    case 'h':
-                        usage(argv[0]);
-                        exit(0);
-                    case 'v':
-                        verbose++;
+// Feed one buffer of a channel to its detector
+// Returns a bit per hop completed in this buffer that found an onset, hop k ending at
+// frame *first_end + k * flux_hop (the first one may have started in the previous buffer);
+// buffers are at most flux_max_frames, 64 hops
+// history holds the last flux_size frames, fill the frames of the hop in progress
+unsigned long long flux_scan(int *samples, int frame_count, float *history, float *mag, int *fill,
+                             float *mean, float decay, int floor, int *first_end){
+    unsigned long long onsets = 0;
+    int frame = 0, n, i, k = 0;
+    float flux;
+    *first_end = flux_hop - *fill;
+    while (frame < frame_count){
+        n = min(flux_hop - *fill, frame_count - frame);
+        for (i = 0; i < n; i++){
+            history[flux_size - flux_hop + *fill + i] = samples[frame + i];
+        }
+        *fill += n;
+        frame += n;
+        if (*fill == flux_hop){
+            flux = flux_of_hop(history, mag);
+            if (flux > floor && flux > flux_ratio * *mean && k < 64){
+                onsets |= 1ULL << k;
+            }
+            *mean = *mean * decay + flux * (1 - decay);
+            memmove(history, history + flux_hop, (flux_size - flux_hop) * sizeof(float));
+            *fill = 0;
+            k++;
+        }
+    }
+    return onsets;
+}
+
+// First onset that ends after frame from, relative to from, -1 if none
+// The onset is placed at the start of the hop that brought it
+// Clears the onsets it passes and the one it returns, a hop triggers once
+int find_flux_trig(unsigned long long *onsets, int first_end, int from){
+    int end;
+    for (; *onsets; *onsets &= *onsets - 1){
+        end = first_end + __builtin_ctzll(*onsets) * flux_hop;
+        if (end > from){
+            *onsets &= *onsets - 1;
+            return max(end - flux_hop - from, 0);
+        }
+    }
+    return -1;
+}
+
+// Sample format handling
+// In order of preference when the sound input offers several formats
+typedef struct {
+    snd_pcm_format_t format;
+    int bytes;
+    int max_sample_value;
+    format_kernels *kernels;
+} sample_format_info;
+
+sample_format_info sample_formats[] = {
+    {SND_PCM_FORMAT_S24_3LE, 3, 0x7FFFFF, S24_3LE_kernels},
+    {SND_PCM_FORMAT_S32_LE, 4, 0x7FFFFF, S32_LE_kernels},
+    {SND_PCM_FORMAT_S24_LE, 4, 0x7FFFFF, S24_LE_kernels},
+    {SND_PCM_FORMAT_S16_LE, 2, 0x7FFF, S16_LE_kernels},
+    {SND_PCM_FORMAT_FLOAT_LE, 4, 0x7FFFFF, FLOAT_LE_kernels},
+    {SND_PCM_FORMAT_UNKNOWN, 0, 0, NULL}
+};
+
+sample_format_info *get_format_info(snd_pcm_format_t format){
+    sample_format_info *fi;
+    for(fi = sample_formats; fi->kernels; fi++){
+        if (fi->format == format) return fi;
+    }
+    return NULL;
+}
+
+// Kernels specialised for this channel count, or the generic ones
+format_kernels *get_format_kernels(sample_format_info *fi, int channel_count){
+    format_kernels *k;
+    for(k = fi->kernels; k->channel_count && (k->channel_count != channel_count); k++);
+    return k;
+}
+
+// Sets the format-dependant kernels and returns bytes per sample, or -1 if unsupported
+int select_format(snd_pcm_format_t format, int channel_count, int *max_sample_value, format_kernels *kernels){
+    sample_format_info *fi;
+    if ((fi = get_format_info(format)) == NULL) return -1;
+    *kernels = *get_format_kernels(fi, channel_count);
+    *max_sample_value = fi->max_sample_value;
+    if (format == SND_PCM_FORMAT_S24_3LE) kernels->find_peak = select_find_peak_S24_3LE(kernels->find_peak);
+    return fi->bytes;
+}
+
+// Audio sources
+// The detectors only see interleaved buffers of buf_frames frames,
+// they do not care whether those come from a soundcard or from a recorded file.
+// Sources hand out frames in place: begin points at up to the requested number of frames,
+// the detectors scan them, then commit releases them. A buffer may take two begin/commit
+// rounds when it wraps around the end of an mmap ring.
+typedef struct audio_source {
+    // Returns frames available at *data, 0 at end of input, negative on error
+    int (*begin)(struct audio_source *src, unsigned char **data, int frames);
+    // Returns 0, or negative on error
+    int (*commit)(struct audio_source *src, int frames);
+    // CLOCK_MONOTONIC capture time of the frame following the last committed one
+    void (*timestamp)(struct audio_source *src, struct timespec *ts);
+    // After begin or commit failed: returns 0 if capture could be restarted, a negative error code if it cannot
+    int (*recover)(struct audio_source *src, int err);
+    void (*close)(struct audio_source *src);
+    snd_pcm_format_t format;
+    unsigned int sample_rate;
+    int channels;
+    int frame_bytes;
+    unsigned char *buf; // Copy of the input, unused in mmap mode
+    // ALSA capture
+    snd_pcm_t *pcm;
+    snd_pcm_uframes_t mmap_offset; // Position of the frames being scanned in the ring
+    snd_pcm_uframes_t period_frames, buffer_frames; // As granted by the driver
+    struct pollfd *pfds; // Poll descriptors of the PCM
+    int pfd_count;
+    // File replay
+    FILE *file;
+    long data_bytes; // Remaining audio bytes, -1 if unknown (raw file)
+    int paced; // Deliver buffers at real-time speed
+    struct timespec deadline; // When the next buffer is due
+#ifdef jack
+    // JACK client, driven by its process callback instead of begin and commit
+    jack_port_t **ports; // One audio input port per channel
+    jack_nframes_t next_frame; // Frame time expected for the next cycle
+#endif
+} audio_source;
+
+// Wait in poll() on the descriptors of the PCM until frames can be read
+// Returns 0, or negative on error
+int alsa_wait(audio_source *src, int frames){
+    snd_pcm_sframes_t avail;
+    unsigned short revents;
+    int err;
+    while (1){
+        if ((avail = snd_pcm_avail_update(src->pcm)) < 0) return avail;
+        if (avail >= frames) return 0;
+        if (snd_pcm_state(src->pcm) == SND_PCM_STATE_PREPARED){
+            // Nothing to wait for until capture runs
+            if ((err = snd_pcm_start(src->pcm)) < 0) return err;
+        }
+        if ((err = poll(src->pfds, src->pfd_count, 1000)) < 0){
+            if (errno == EINTR) continue; // SIGUSR1, not an overrun
+            return -errno;
+        }
+        if (err == 0) return -EIO; // Timeout, no data for a second
+        // An overrun shows up in the next snd_pcm_avail_update
+        if ((err = snd_pcm_poll_descriptors_revents(src->pcm, src->pfds, src->pfd_count, &revents)) < 0) return err;
+    }
+}
+
+int alsa_read_begin(audio_source *src, unsigned char **data, int frames){
+    snd_pcm_sframes_t got;
+    int err;
+    *data = src->buf;
+    if ((err = alsa_wait(src, frames)) < 0) return err;
+    while ((got = snd_pcm_readi(src->pcm, src->buf, frames)) == -EINTR); // SIGUSR1, not an overrun
+    return got;
+}
+
+int copy_commit(audio_source *src, int frames){
+    return 0; // Nothing to release, data was copied
+}
+
+// Scan the DMA ring in place
+int alsa_mmap_begin(audio_source *src, unsigned char **data, int frames){
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, contiguous;
+    int err;
+    if ((err = alsa_wait(src, frames)) < 0) return err;
+    contiguous = frames;
+    if ((err = snd_pcm_mmap_begin(src->pcm, &areas, &offset, &contiguous)) < 0) return err;
+    // Interleaved: every channel shares the first area, first and step are in bits
+    *data = (unsigned char *)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+    src->mmap_offset = offset;
+    return contiguous; // Less than frames when the area wraps
+}
+
+int alsa_mmap_commit(audio_source *src, int frames){
+    snd_pcm_sframes_t committed;
+    committed = snd_pcm_mmap_commit(src->pcm, src->mmap_offset, frames);
+    if (committed < 0) return committed;
+    return (committed == frames) ? 0 : -EPIPE;
+}
+
+void alsa_timestamp(audio_source *src, struct timespec *ts){
+    snd_pcm_uframes_t avail;
+    snd_htimestamp_t tstamp;
+    if ((snd_pcm_htimestamp(src->pcm, &avail, &tstamp) < 0) || (!tstamp.tv_sec && !tstamp.tv_nsec)){
+        clock_gettime(CLOCK_MONOTONIC, ts); // Not running yet
+        return;
+    }
+    // At tstamp, avail more frames had been captured after ours
+    frame_time(ts, &tstamp, -(long)avail, src->sample_rate);
+}
+
+// Overrun (-EPIPE) or suspend (-ESTRPIPE): prepare again, capture restarts with the next begin
+int alsa_recover(audio_source *src, int err){
+    return snd_pcm_recover(src->pcm, err, 1);
+}
+
+void alsa_close(audio_source *src){
+    snd_pcm_close(src->pcm);
+    free(src->pfds);
+}
+
+int open_alsa_source(audio_source *src, char *device_name, snd_pcm_format_t format, unsigned int sample_rate, int channels,
+                     int use_mmap, int period_frames, unsigned int periods){
+    int err;
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_uframes_t period_size;
+
+    if ((err = snd_pcm_open (&src->pcm, device_name, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+        fprintf (stderr, "cannot open audio device %s (%s)\n", 
+             device_name,
+             snd_strerror(err));
+        return err;
+    }else{
+        printf ("audio device set to %s\n", device_name);
+    }
+       
+    if ((err = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
+        fprintf (stderr, "cannot allocate hardware parameter structure (%s)\n",
+             snd_strerror(err));
+        return err;
+    }
+             
+    if ((err = snd_pcm_hw_params_any (src->pcm, hw_params)) < 0) {
+        fprintf (stderr, "cannot initialize hardware parameter structure (%s)\n",
+             snd_strerror(err));
+        return err;
+    }
+
+    if ((err = snd_pcm_hw_params_set_access (src->pcm, hw_params,
+            use_mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+        fprintf (stderr, "cannot set access type (%s)\n",
+             snd_strerror(err));
+        return err;
+    }
+
+    if (format != SND_PCM_FORMAT_UNKNOWN){ // Requested on command line
+        err = snd_pcm_hw_params_set_format (src->pcm, hw_params, format);
+    }else{ // First native format, avoids plughw conversion
+        sample_format_info *fi;
+        err = -EINVAL;
+        for(fi = sample_formats; fi->kernels && (err < 0); fi++){
+            format = fi->format;
+            err = snd_pcm_hw_params_set_format (src->pcm, hw_params, format);
+        }
+    }
+    if (err < 0) {
+        fprintf (stderr, "cannot set sample format (%s)\n",
+             snd_strerror(err));
+        fprintf (stderr, "use arecord to test your soundcard input format(s)\n");
+        return err;
+    }
+    src->format = format;
+
+    if ((err = snd_pcm_hw_params_set_rate_near (src->pcm, hw_params, &sample_rate, 0)) < 0) {
+        // Was 44100, caused a segfault
+        fprintf (stderr, "cannot set sample rate to %u (%s)\n", sample_rate,
+             snd_strerror(err));
+        return err;
+    }
+    src->sample_rate = sample_rate;
+
+    if ((err = snd_pcm_hw_params_set_channels (src->pcm, hw_params, channels)) < 0) {
+        fprintf (stderr, "cannot set channel count to %u (%s)\n", channels,
+             snd_strerror(err));
+        return err;
+    }
+    src->channels = channels;
+
+    // Without these the driver picks period and buffer sizes, often far too large
+    period_size = period_frames;
+    if ((err = snd_pcm_hw_params_set_period_size_near (src->pcm, hw_params, &period_size, 0)) < 0) {
+        fprintf (stderr, "cannot set period size to %u frames (%s)\n", period_frames,
+             snd_strerror(err));
+        return err;
+    }
+    if ((err = snd_pcm_hw_params_set_periods_near (src->pcm, hw_params, &periods, 0)) < 0) {
+        fprintf (stderr, "cannot set period count to %u (%s)\n", periods,
+             snd_strerror(err));
+        return err;
+    }
+
+    if ((err = snd_pcm_hw_params (src->pcm, hw_params)) < 0) {
+        fprintf (stderr, "cannot set parameters (%s)\n",
+             snd_strerror(err));
+        return err;
+    }else{
+        fprintf (stderr, "hardware parameters set\n");
+    }
+
+    // Check what the device actually granted
+    snd_pcm_hw_params_get_period_size (hw_params, &src->period_frames, 0);
+    snd_pcm_hw_params_get_buffer_size (hw_params, &src->buffer_frames);
+    snd_pcm_hw_params_free (hw_params);
+    if (src->period_frames != period_frames){
+        fprintf (stderr, "period size %u frames not available, using %lu\n", period_frames, src->period_frames);
+    }
+
+    // Monotonic timestamps, to place onsets in time for the sequencer
+    if ((err = snd_pcm_sw_params_malloc (&sw_params)) < 0) {
+        fprintf (stderr, "cannot allocate software parameter structure (%s)\n",
+             snd_strerror(err));
+        return err;
+    }
+    snd_pcm_sw_params_current (src->pcm, sw_params);
+    snd_pcm_sw_params_set_tstamp_mode (src->pcm, sw_params, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params_set_tstamp_type (src->pcm, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+    if ((err = snd_pcm_sw_params (src->pcm, sw_params)) < 0) {
+        fprintf (stderr, "cannot set software parameters (%s)\n",
+             snd_strerror(err));
+    }
+    snd_pcm_sw_params_free (sw_params);
+
+    if ((err = snd_pcm_prepare (src->pcm)) < 0) {
+        fprintf (stderr, "cannot prepare audio interface for use (%s)\n",
+             snd_strerror(err));
+        return err;
+    }else{
+        fprintf (stderr, "audio interface prepared for use\n");
+    }
+    src->pfd_count = snd_pcm_poll_descriptors_count(src->pcm);
+    src->pfds = calloc(max(src->pfd_count, 1), sizeof(struct pollfd));
+    if ((err = snd_pcm_poll_descriptors(src->pcm, src->pfds, src->pfd_count)) < 0) {
+        fprintf (stderr, "cannot get poll descriptors (%s)\n",
+             snd_strerror(err));
+        return err;
+    }
+    if (use_mmap){
+        src->begin = alsa_mmap_begin;
+        src->commit = alsa_mmap_commit;
+        fprintf (stderr, "mmap capture\n");
+    }else{
+        src->begin = alsa_read_begin;
+        src->commit = copy_commit;
+    }
+    src->timestamp = alsa_timestamp;
+    src->recover = alsa_recover;
+    src->close = alsa_close;
+    return 0;
+}
+
+int file_begin(audio_source *src, unsigned char **data, int frames){
+    size_t wanted, got;
+    unsigned char *buf = src->buf;
+    *data = buf;
+    wanted = (size_t)frames * src->frame_bytes;
+    if ((src->data_bytes >= 0) && (wanted > (size_t)src->data_bytes)){
+        wanted = src->data_bytes;
+    }
+    got = fread(buf, 1, wanted, src->file);
+    if (src->data_bytes >= 0) src->data_bytes -= got;
+    got -= got % src->frame_bytes; // Drop incomplete frame at end of file
+    if (got == 0){
+        return ferror(src->file) ? -EIO : 0;
+    }
+    // Pad last buffer with silence, detectors always process whole buffers
+    memset(buf + got, 0, (size_t)frames * src->frame_bytes - got);
+    if (src->paced){
+        // Buffer is available when its last frame would have been captured
+        src->deadline.tv_nsec += (long)((frames * 1000000000LL) / src->sample_rate);
+        while (src->deadline.tv_nsec >= 1000000000L){
+            src->deadline.tv_nsec -= 1000000000L;
+            src->deadline.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &src->deadline, NULL) == EINTR && keepRunning);
+    }
+    return frames;
+}
+
+void file_timestamp(audio_source *src, struct timespec *ts){
+    if (src->paced){
+        *ts = src->deadline;
+    }else{
+        clock_gettime(CLOCK_MONOTONIC, ts);
+    }
+}
+
+void file_close(audio_source *src){
+    fclose(src->file);
+}
+
+unsigned int get_le16(unsigned char *p){
+    return p[0] | p[1]<<8;
+}
+
+unsigned int get_le32(unsigned char *p){
+    return p[0] | p[1]<<8 | p[2]<<16 | (unsigned int)p[3]<<24;
+}
+
+// Parse RIFF/WAVE header, leave file positioned at start of audio data
+int read_wav_header(audio_source *src){
+    unsigned char hdr[40];
+    unsigned int chunk_size, audio_format = 0, bits = 0, block_align = 0;
+    int got_fmt = 0;
+
+    if (fread(hdr, 1, 12, src->file) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr+8, "WAVE", 4)){
+        fprintf (stderr, "not a WAV file\n");
+        return -1;
+    }
+    while (fread(hdr, 1, 8, src->file) == 8){
+        chunk_size = get_le32(hdr+4);
+        if (!memcmp(hdr, "fmt ", 4) && chunk_size >= 16){
+            if (fread(hdr, 1, min(chunk_size, sizeof(hdr)), src->file) != min(chunk_size, sizeof(hdr))) break;
+            audio_format = get_le16(hdr);
+            src->channels = get_le16(hdr+2);
+            src->sample_rate = get_le32(hdr+4);
+            block_align = get_le16(hdr+12);
+            bits = get_le16(hdr+14);
+            if (audio_format == 0xFFFE && chunk_size >= 40){ // WAVE_FORMAT_EXTENSIBLE
+                audio_format = get_le16(hdr+24); // Sub-format GUID starts with format tag
+            }
+            got_fmt = 1;
+            if (chunk_size > sizeof(hdr)) fseek(src->file, chunk_size - sizeof(hdr), SEEK_CUR);
+        }else if (!memcmp(hdr, "data", 4)){
+            if (!got_fmt) break;
+            if ((audio_format != 1 && audio_format != 3) || !src->channels){ // PCM or IEEE float
+                fprintf (stderr, "unsupported WAV encoding %u\n", audio_format);
+                return -1;
+            }
+            if (audio_format == 3){
+                if (bits != 32 || block_align != 4 * src->channels){
+                    fprintf (stderr, "unsupported WAV float size %u bits\n", bits);
+                    return -1;
+                }
+                src->format = SND_PCM_FORMAT_FLOAT_LE;
+            }else if (bits == 16 && block_align == 2 * src->channels){
+                src->format = SND_PCM_FORMAT_S16_LE;
+            }else if (bits == 24 && block_align == 3 * src->channels){
+                src->format = SND_PCM_FORMAT_S24_3LE;
+            }else if (block_align == 4 * src->channels){
+                // 32-bit, or 24-bit left-justified in a 32-bit container
+                src->format = SND_PCM_FORMAT_S32_LE;
+            }else{
+                fprintf (stderr, "unsupported WAV sample size %u bits\n", bits);
+                return -1;
+            }
+            src->data_bytes = chunk_size;
+            return 0;
+        }else{
+            fseek(src->file, chunk_size + (chunk_size & 1), SEEK_CUR); // Chunks are word-aligned
+        }
+    }
+    fprintf (stderr, "WAV data not found\n");
+    return -1;
+}
+
+int open_file_source(audio_source *src, char *file_name, snd_pcm_format_t format, unsigned int sample_rate, int channels, int paced){
+    int len;
+    if ((src->file = fopen(file_name, "rb")) == NULL){
+        fprintf (stderr, "cannot open input file %s (%s)\n", file_name, strerror(errno));
+        return -1;
+    }
+    printf ("input file set to %s\n", file_name);
+    len = strlen(file_name);
+    if (len > 4 && !strcasecmp(file_name + len - 4, ".wav")){
+        if (read_wav_header(src) < 0){
+            fclose(src->file);
+            return -1;
+        }
+    }else{ // Raw interleaved samples, layout from command line
+        src->format = (format != SND_PCM_FORMAT_UNKNOWN) ? format : SND_PCM_FORMAT_S24_3LE;
+        src->sample_rate = sample_rate;
+        src->channels = channels;
+        src->data_bytes = -1;
+    }
+    src->paced = paced;
+    clock_gettime(CLOCK_MONOTONIC, &src->deadline);
+    src->begin = file_begin;
+    src->commit = copy_commit;
+    src->timestamp = file_timestamp;
+    src->close = file_close;
+    return 0;
+}
+
+#ifdef jack
+// JACK client
+// Each channel has its own audio input port, a mono FLOAT_LE buffer for the scan kernels
+void jack_close(audio_source *src){
+    jack_client_close(jack_client);
+    free(src->ports);
+}
+
+int open_jack_source(audio_source *src, char *client_name, int channels){
+    jack_status_t status;
+    char port_name[32];
+    int c;
+    if ((jack_client = jack_client_open(client_name, JackNoStartServer, &status)) == NULL){
+        fprintf (stderr, "cannot connect to JACK server as %s (status 0x%x)\n", client_name, status);
+        return -1;
+    }
+    src->format = SND_PCM_FORMAT_FLOAT_LE;
+    src->sample_rate = jack_rate = jack_get_sample_rate(jack_client);
+    src->period_frames = jack_get_buffer_size(jack_client);
+    src->channels = channels;
+    src->ports = calloc(channels, sizeof(jack_port_t *));
+    for (c = 0; c < channels; c++){
+        snprintf(port_name, sizeof(port_name), "in_%d", c);
+        if ((src->ports[c] = jack_port_register(jack_client, port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0)) == NULL){
+            fprintf (stderr, "cannot register JACK port %s\n", port_name);
+            return -1;
+        }
+    }
+    if ((jack_midi_port = jack_port_register(jack_client, "midi_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0)) == NULL){
+        fprintf (stderr, "cannot register JACK port midi_out\n");
+        return -1;
+    }
+    src->close = jack_close;
+    fprintf (stderr, "JACK client %s, %u Hz, %lu frames per period\n",
+        jack_get_client_name(jack_client), src->sample_rate, src->period_frames);
+    return 0;
+}
+#endif
+
+// Kernel benchmark
+// Times the format-dependant scanning kernels over synthetic buffers,
+// to see how much of the per-buffer time budget they use
+
+// CPU cycle counter, from perf events (works on ARM too) or the x86 time stamp counter
+int cycles_fd = -1;
+
+void open_cycle_counter(void){
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CPU_CYCLES;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    cycles_fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+// Returns 0 if no cycle counter is available
+unsigned long long read_cycles(void){
+    unsigned long long cycles;
+    if ((cycles_fd >= 0) && (read(cycles_fd, &cycles, sizeof(cycles)) == sizeof(cycles))){
+        return cycles;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+volatile int bench_sink; // Keeps results of inlined kernels alive
+
+double elapsed_ns(struct timespec *t0, struct timespec *t1){
+    return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+typedef enum {
+    SHAPE_SILENCE, // Noise floor only, trigger search scans whole buffer
+    SHAPE_NOISE,   // Full range noise
+    SHAPE_HIT,     // Decaying burst in the second half of the buffer
+    SHAPE_COUNT
+} Shape;
+const char * shape_names[] = {"silence", "noise", "hit"};
+
+// Writes sample value x (-1.0..1.0) in the given format
+void encode_sample(unsigned char *p, sample_format_info *fi, double x){
+    int a, b;
+    float v;
+    if (fi->format == SND_PCM_FORMAT_FLOAT_LE){
+        v = x;
+        memcpy(p, &v, 4);
+        return;
+    }
+    if (fi->format == SND_PCM_FORMAT_S32_LE){
+        a = (int)(x * 0x7FFFFFFF);
+    }else{
+        a = (int)(x * fi->max_sample_value);
+    }
+    for(b = 0; b < fi->bytes; b++){
+        p[b] = (a >> (8 * b)) & 0xFF; // Little-endian
+    }
+}
+
+void fill_bench_buffer(unsigned char *buf, sample_format_info *fi, int channel_count, int frame_count, Shape shape){
+    int frame, c;
+    double x;
+    for(frame = 0; frame < frame_count; frame++){
+        for(c = 0; c < channel_count; c++){
+            x = ((rand() % 64) - 32) / (double)0x800000; // Noise floor
+            if (shape == SHAPE_NOISE){
+                x = 2.0 * rand() / RAND_MAX - 1.0;
+            }else if ((shape == SHAPE_HIT) && (frame >= frame_count / 2)){
+                x = 0.9 * exp(-(frame - frame_count / 2) / 16.0) * ((frame & 1) ? -1 : 1);
+            }
+            encode_sample(buf, fi, x);
+            buf += fi->bytes;
+        }
+    }
+}
+
+void print_bench(char *kernel, snd_pcm_format_t format, int channel_count, int frame_count, Shape shape,
+                 unsigned int sample_rate, long iterations, double ns, unsigned long long cycles){
+    double ns_per_buffer = ns / iterations;
+    double budget_ns = frame_count * 1e9 / sample_rate;
+    printf("%-16s %-8s %3d %5d %-8s %10.2f %11.0f %8.2f %7.3f%%\n",
+        kernel, snd_pcm_format_name(format), channel_count, frame_count, shape_names[shape],
+        frame_count * iterations * 1e3 / ns, // frames per µs = Mframes/s
+        ns_per_buffer,
+        cycles ? (double)cycles / ((double)iterations * frame_count * channel_count) : 0.0,
+        100.0 * ns_per_buffer / budget_ns);
+}
+
+void run_benchmark(snd_pcm_format_t only_format, unsigned int sample_rate){
+    static const int channel_counts[] = {1, 2, 4, 6, 8, 10, 16, 32, 64, 128};
+    static const int frame_counts[] = {16, 32, 64, 128, 256};
+    int ci, bi, c, channel_count, frame_count, trig_lvl;
+    long i, iterations;
+    Shape shape;
+    sample_format_info *fi;
+    format_kernels *generic, *specialised;
+    unsigned char *buf;
+    int *planes, plane_stride;
+    float *flux_history, *flux_mag, flux_mean[128];
+    float flux_decay = exp(-flux_hop / (flux_mean_ms * sample_rate / 1000.0));
+    int flux_fill[128], flux_first_end;
+    int max_l[128], ref_max_l[128], previous_max_l[128], previous_max_v[128], plane_peak[128], peak;
+    typedef struct {
+        char *name;
+        void (*kernel)(int channel_count, unsigned char *buf, int frame_count, int *max_l, int *previous_max_l, int *previous_max_v);
+    } peak_kernel;
+    peak_kernel peak_kernels[4];
+    int ki, kernel_count;
+    struct timespec t0, t1;
+    unsigned long long cy0, cy1;
+
+    open_cycle_counter();
+    printf("cycle counter: %s\n", (cycles_fd >= 0) ? "perf events" :
+#if defined(__x86_64__) || defined(__i386__)
+        "time stamp counter");
+#else
+        "none");
+#endif
+    printf("%-16s %-8s %3s %5s %-8s %10s %11s %8s %8s\n",
+        "kernel", "format", "ch", "frames", "shape", "Mframes/s", "ns/buffer", "cyc/smp", "budget");
+    buf = malloc(128 * 256 * 4);
+    planes = aligned_alloc(64, 128 * plane_stride_for(256) * sizeof(int));
+    flux_history = aligned_alloc(64, 128 * flux_size * sizeof(float));
+    flux_mag = aligned_alloc(64, 128 * flux_size * sizeof(float));
+    memset(flux_history, 0, 128 * flux_size * sizeof(float));
+    memset(flux_mag, 0, 128 * flux_size * sizeof(float));
+    memset(flux_mean, 0, sizeof(flux_mean));
+    memset(flux_fill, 0, sizeof(flux_fill));
+    memset(max_l, 0, sizeof(max_l));
+    memset(previous_max_l, 0, sizeof(previous_max_l));
+    memset(plane_peak, 0, sizeof(plane_peak));
+    for(fi = sample_formats; fi->kernels; fi++){
+        if ((only_format != SND_PCM_FORMAT_UNKNOWN) && (only_format != fi->format)) continue;
+        trig_lvl = fi->max_sample_value / 32; // -30 db
+        generic = get_format_kernels(fi, 0);
+        for(ci = 0; ci < sizeof(channel_counts) / sizeof(channel_counts[0]); ci++){
+            channel_count = channel_counts[ci];
+            specialised = get_format_kernels(fi, channel_count);
+            // Generic scalar kernel first, then every variant this CPU can run
+            kernel_count = 0;
+            peak_kernels[kernel_count++] = (peak_kernel){"find_peak", generic->find_peak};
+            if (specialised != generic){
+                peak_kernels[kernel_count++] = (peak_kernel){"find_peak_ch", specialised->find_peak};
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            if (fi->format == SND_PCM_FORMAT_S24_3LE){
+                if (__builtin_cpu_supports("sse4.1")) peak_kernels[kernel_count++] = (peak_kernel){"find_peak_sse41", find_peak_S24_3LE_sse41};
+                if (__builtin_cpu_supports("avx2")) peak_kernels[kernel_count++] = (peak_kernel){"find_peak_avx2", find_peak_S24_3LE_avx2};
+            }
+#endif
+            for(bi = 0; bi < sizeof(frame_counts) / sizeof(frame_counts[0]); bi++){
+                frame_count = frame_counts[bi];
+                plane_stride = plane_stride_for(frame_count); // As laid out by the capture thread
+                // About 4M samples per measurement
+                iterations = 1 + (4L << 20) / (channel_count * frame_count);
+                for(shape = 0; shape < SHAPE_COUNT; shape++){
+                    fill_bench_buffer(buf, fi, channel_count, frame_count, shape);
+
+                    // Method 1, all channels in one pass
+                    // Reference results from the scalar kernel
+                    memset(ref_max_l, 0, sizeof(ref_max_l));
+                    peak_kernels[0].kernel(channel_count, buf, frame_count, ref_max_l, previous_max_l, previous_max_v);
+                    for(ki = 0; ki < kernel_count; ki++){
+                        memset(max_l, 0, sizeof(max_l));
+                        peak_kernels[ki].kernel(channel_count, buf, frame_count, max_l, previous_max_l, previous_max_v);
+                        if (memcmp(max_l, ref_max_l, channel_count * sizeof(int))){
+                            printf("%s: results differ from scalar kernel!\n", peak_kernels[ki].name);
+                        }
+                        clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+                        cy0 = read_cycles();
+                        for(i = 0; i < iterations; i++){
+                            peak_kernels[ki].kernel(channel_count, buf, frame_count, max_l, previous_max_l, previous_max_v);
+                        }
+                        cy1 = read_cycles();
+                        clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+                        print_bench(peak_kernels[ki].name, fi->format, channel_count, frame_count, shape, sample_rate,
+                            iterations, elapsed_ns(&t0, &t1), cy1 - cy0);
+                    }
+
+                    // Method 2, deinterleave whole buffer once
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+                    cy0 = read_cycles();
+                    for(i = 0; i < iterations; i++){
+                        generic->deinterleave(channel_count, buf, frame_count, planes, plane_stride, plane_peak);
+                    }
+                    cy1 = read_cycles();
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+                    print_bench("deinterleave", fi->format, channel_count, frame_count, shape, sample_rate,
+                        iterations, elapsed_ns(&t0, &t1), cy1 - cy0);
+                    if (specialised != generic){
+                        clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+                        cy0 = read_cycles();
+                        for(i = 0; i < iterations; i++){
+                            specialised->deinterleave(channel_count, buf, frame_count, planes, plane_stride, plane_peak);
+                        }
+                        cy1 = read_cycles();
+                        clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+                        print_bench("deinterleave_ch", fi->format, channel_count, frame_count, shape, sample_rate,
+                            iterations, elapsed_ns(&t0, &t1), cy1 - cy0);
+                    }
+
+                    // Method 2, scan every channel plane, as in STATE_PEAK
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+                    cy0 = read_cycles();
+                    for(i = 0; i < iterations; i++){
+                        for(c = 0; c < channel_count; c++){
+                            peak = 0;
+                            find_channel_peak(planes + c * plane_stride, frame_count, &peak);
+                            bench_sink += peak;
+                        }
+                    }
+                    cy1 = read_cycles();
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+                    print_bench("channel_peak", fi->format, channel_count, frame_count, shape, sample_rate,
+                        iterations, elapsed_ns(&t0, &t1), cy1 - cy0);
+
+                    // Method 2, scan every channel plane, as in STATE_IDLE
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+                    cy0 = read_cycles();
+                    for(i = 0; i < iterations; i++){
+                        for(c = 0; c < channel_count; c++){
+                            bench_sink += find_channel_trig(planes + c * plane_stride, frame_count, trig_lvl);
+                        }
+                    }
+                    cy1 = read_cycles();
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+                    print_bench("channel_trig", fi->format, channel_count, frame_count, shape, sample_rate,
+                        iterations, elapsed_ns(&t0, &t1), cy1 - cy0);
+
+                    // Method 3, spectral flux of every channel plane
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+                    cy0 = read_cycles();
+                    for(i = 0; i < iterations; i++){
+                        for(c = 0; c < channel_count; c++){
+                            bench_sink += flux_scan(planes + c * plane_stride, frame_count,
+                                flux_history + c * flux_size, flux_mag + c * flux_size, &flux_fill[c],
+                                &flux_mean[c], flux_decay, trig_lvl, &flux_first_end);
+                        }
+                    }
+                    cy1 = read_cycles();
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+                    print_bench("spectral_flux", fi->format, channel_count, frame_count, shape, sample_rate,
+                        iterations, elapsed_ns(&t0, &t1), cy1 - cy0);
+                }
+            }
+        }
+    }
+    free(buf);
+    free(planes);
+    free(flux_history);
+    free(flux_mag);
+    if (cycles_fd >= 0) close(cycles_fd);
+}
+
+// Channel state
+// One array per field rather than one struct per channel: the detector loops read a
+// field for a run of channels, and a 64-input card keeps its state in a few cache lines.
+// Every array starts on its own cache line, nothing is shared between capture threads.
+typedef enum {
+    STATE_IDLE, // Until trig level reached
+    STATE_PEAK, // Scan for peak until time elapsed
+    STATE_WAIT, // Inhibit retrigger until time2 elapsed
+    STATE_UNKNOWN // Only for init
+} State;
+const char * state_names[] = {"IDLE", "PEAK", "WAIT"};
+
+struct detector_engine;
+
+typedef struct {
+    const struct detector_engine **engine; // Detection method of each channel
+    int *trig_level;
+    int *midi_channel, *midi_note;
+    timer *note_off_timer; // Pending when a note is on
+    struct timespec *onset_time; // Capture time of the current hit
+    long long *onset_pos; // Frame position of the current hit in the input stream
+    unsigned long long *busy; // Bit set while a channel has work in the current buffer
+    // Method 1
+    int *waiting, *trig_delay_buffers; // Used for de-bouncing
+    float *decay, *decay_rate, *decay_factor;
+    int *rising;
+    int *previous_max_l, *previous_previous_max_l;
+    int *previous_max_v, *previous_previous_max_v;
+    int *max_l;
+    // Methods 2 and 3
+    State *state, *old_state;
+    int *peak_frames, *wait_frames, *frame_count;
+    int *peak_level;
+    timer *retrigger_timer;
+    int *start_frame; // Where the retrigger inhibit ended in the current buffer
+    // Method 3
+    float *flux_history; // flux_size frames per channel
+    float *flux_mag; // Bin magnitudes of the previous hop, flux_size per channel
+    float *flux_mean;
+    int *flux_fill, *flux_first_end, *flux_quiet;
+    unsigned long long *flux_onsets; // Onsets found in the current buffer
+    // Early velocity
+    int *early_frames; // Note on this long after the trigger, 0 to wait for the peak window
+    int *early_count; // Frames left until the early note on, 0 once sent
+    int *early_velocity; // Velocity sent early, 0 if none
+    int *early_peak; // Peak of the early frames
+    float *early_gain; // Predicted peak over peak of the early frames
+    // Calibration, sums over the hits of early peak e and final peak p: e*e, e*p, p*p
+    double *cal_ee, *cal_ep, *cal_pp;
+    int *cal_hits;
+    // Compare mode, last hit of each channel and its differences with the first method
+    long long *cmp_pos; // Frame position where the note on was decided
+    int *cmp_velocity;
+    int *cmp_open; // Not paired yet, for the first method a bit per other method
+    int *cmp_hits, *cmp_matched;
+    long long *cmp_delay, *cmp_delay_max; // Frames
+    long long *cmp_vdiff, *cmp_vsq;
+    // Meters
+    int *last_velocity;
+    unsigned int *note_count;
+    // Planar copy of the current buffer, one plane per input
+    int plane_stride;
+    int *planes;
+    int *plane_peak; // Highest level of each plane in the current buffer
+} channel_table;
+
+#define mask_words(channels) (((channels) + 63) / 64)
+
+// Zeroed, cache-aligned array of count elements
+void *channel_array(int count, size_t size){
+    size_t bytes = (count * size + 63) & ~(size_t)63;
+    void *p = aligned_alloc(64, bytes);
+    if (p == NULL){
+        fprintf (stderr, "cannot allocate channel state\n");
+        exit (1);
+    }
+    memset(p, 0, bytes);
+    return p;
+}
+
+// Channels are the detectors, inputs the planes they scan, more channels than inputs in compare mode
+void channel_table_alloc(channel_table *ch, int channels, int inputs){
+    ch->engine = channel_array(channels, sizeof(struct detector_engine *));
+    ch->trig_level = channel_array(channels, sizeof(int));
+    ch->midi_channel = channel_array(channels, sizeof(int));
+    ch->midi_note = channel_array(channels, sizeof(int));
+    ch->note_off_timer = channel_array(channels, sizeof(timer));
+    ch->onset_time = channel_array(channels, sizeof(struct timespec));
+    ch->onset_pos = channel_array(channels, sizeof(long long));
+    ch->busy = channel_array(mask_words(channels), sizeof(unsigned long long));
+    ch->waiting = channel_array(channels, sizeof(int));
+    ch->trig_delay_buffers = channel_array(channels, sizeof(int));
+    ch->decay = channel_array(channels, sizeof(float));
+    ch->decay_rate = channel_array(channels, sizeof(float));
+    ch->decay_factor = channel_array(channels, sizeof(float));
+    ch->rising = channel_array(channels, sizeof(int));
+    ch->previous_max_l = channel_array(channels, sizeof(int));
+    ch->previous_previous_max_l = channel_array(channels, sizeof(int));
+    ch->previous_max_v = channel_array(channels, sizeof(int));
+    ch->previous_previous_max_v = channel_array(channels, sizeof(int));
+    ch->max_l = channel_array(channels, sizeof(int));
+    ch->state = channel_array(channels, sizeof(State));
+    ch->old_state = channel_array(channels, sizeof(State));
+    ch->peak_frames = channel_array(channels, sizeof(int));
+    ch->wait_frames = channel_array(channels, sizeof(int));
+    ch->frame_count = channel_array(channels, sizeof(int));
+    ch->peak_level = channel_array(channels, sizeof(int));
+    ch->retrigger_timer = channel_array(channels, sizeof(timer));
+    ch->start_frame = channel_array(channels, sizeof(int));
+    ch->flux_history = channel_array(channels * flux_size, sizeof(float));
+    ch->flux_mag = channel_array(channels * flux_size, sizeof(float));
+    ch->flux_mean = channel_array(channels, sizeof(float));
+    ch->flux_fill = channel_array(channels, sizeof(int));
+    ch->flux_first_end = channel_array(channels, sizeof(int));
+    ch->flux_quiet = channel_array(channels, sizeof(int));
+    ch->flux_onsets = channel_array(channels, sizeof(unsigned long long));
+    ch->early_frames = channel_array(channels, sizeof(int));
+    ch->early_count = channel_array(channels, sizeof(int));
+    ch->early_velocity = channel_array(channels, sizeof(int));
+    ch->early_peak = channel_array(channels, sizeof(int));
+    ch->early_gain = channel_array(channels, sizeof(float));
+    ch->cal_ee = channel_array(channels, sizeof(double));
+    ch->cal_ep = channel_array(channels, sizeof(double));
+    ch->cal_pp = channel_array(channels, sizeof(double));
+    ch->cal_hits = channel_array(channels, sizeof(int));
+    ch->cmp_pos = channel_array(channels, sizeof(long long));
+    ch->cmp_velocity = channel_array(channels, sizeof(int));
+    ch->cmp_open = channel_array(channels, sizeof(int));
+    ch->cmp_hits = channel_array(channels, sizeof(int));
+    ch->cmp_matched = channel_array(channels, sizeof(int));
+    ch->cmp_delay = channel_array(channels, sizeof(long long));
+    ch->cmp_delay_max = channel_array(channels, sizeof(long long));
+    ch->cmp_vdiff = channel_array(channels, sizeof(long long));
+    ch->cmp_vsq = channel_array(channels, sizeof(long long));
+    ch->last_velocity = channel_array(channels, sizeof(int));
+    ch->note_count = channel_array(channels, sizeof(unsigned int));
+    ch->plane_stride = plane_stride_for(buf_frames);
+    ch->planes = channel_array(inputs * ch->plane_stride, sizeof(int));
+    ch->plane_peak = channel_array(inputs, sizeof(int));
+}
+
+// Early velocity calibration
+// The predicted peak is early_gain times the peak of the early frames. The least squares
+// gain over the hits of a take is sum(e*p) / sum(e*e), its residual gives the velocity error.
+void calibration_add(channel_table *ch, int c){
+    double e = ch->early_peak[c], p = ch->peak_level[c];
+    ch->cal_ee[c] += e * e;
+    ch->cal_ep[c] += e * p;
+    ch->cal_pp[c] += p * p;
+    ch->cal_hits[c]++;
+}
+
+// RMS velocity error of a gain over the calibration hits
+double calibration_error(channel_table *ch, int c, double gain, int max_sample_value){
+    double sq = ch->cal_pp[c] - 2 * gain * ch->cal_ep[c] + gain * gain * ch->cal_ee[c];
+    return sqrt(max(sq, 0.0) / ch->cal_hits[c]) * 126 / (max_sample_value - ch->trig_level[c]);
+}
+
+// Next channel from c on whose bit is set in mask, -1 if none
+int next_channel(unsigned long long *mask, int channels, int c){
+    int w = c / 64;
+    unsigned long long bits;
+    if (c >= channels) return -1;
+    bits = mask[w] & (~0ULL << (c % 64));
+    while (bits == 0){
+        if (++w >= mask_words(channels)) return -1;
+        bits = mask[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+void channel_table_free(channel_table *ch){
+    free(ch->engine);
+    free(ch->trig_level);
+    free(ch->midi_channel);
+    free(ch->midi_note);
+    free(ch->note_off_timer);
+    free(ch->onset_time);
+    free(ch->onset_pos);
+    free(ch->busy);
+    free(ch->waiting);
+    free(ch->trig_delay_buffers);
+    free(ch->decay);
+    free(ch->decay_rate);
+    free(ch->decay_factor);
+    free(ch->rising);
+    free(ch->previous_max_l);
+    free(ch->previous_previous_max_l);
+    free(ch->previous_max_v);
+    free(ch->previous_previous_max_v);
+    free(ch->max_l);
+    free(ch->state);
+    free(ch->old_state);
+    free(ch->peak_frames);
+    free(ch->wait_frames);
+    free(ch->frame_count);
+    free(ch->peak_level);
+    free(ch->retrigger_timer);
+    free(ch->start_frame);
+    free(ch->flux_history);
+    free(ch->flux_mag);
+    free(ch->flux_mean);
+    free(ch->flux_fill);
+    free(ch->flux_first_end);
+    free(ch->flux_quiet);
+    free(ch->flux_onsets);
+    free(ch->early_frames);
+    free(ch->early_count);
+    free(ch->early_velocity);
+    free(ch->early_peak);
+    free(ch->early_gain);
+    free(ch->cal_ee);
+    free(ch->cal_ep);
+    free(ch->cal_pp);
+    free(ch->cal_hits);
+    free(ch->cmp_pos);
+    free(ch->cmp_velocity);
+    free(ch->cmp_open);
+    free(ch->cmp_hits);
+    free(ch->cmp_matched);
+    free(ch->cmp_delay);
+    free(ch->cmp_delay_max);
+    free(ch->cmp_vdiff);
+    free(ch->cmp_vsq);
+    free(ch->last_velocity);
+    free(ch->note_count);
+    free(ch->planes);
+    free(ch->plane_peak);
+}
+
+// Input to MIDI mapping
+// By default input c plays base_note on MIDI channel c % 16, the next 16 inputs play
+// base_note + 1 and so on, so that 64 inputs still give 64 distinct notes.
+// With -C every input plays on the same MIDI channel, input c plays base_note + c.
+int base_note = 60;
+int single_midi_channel = -1; // 0..15, -1 to spread inputs over the 16 channels
+
+void map_input(int input, int *midi_channel, int *midi_note){
+    if (single_midi_channel >= 0){
+        *midi_channel = single_midi_channel;
+        *midi_note = base_note + input;
+    }else{
+        *midi_channel = input & 0x0F;
+        *midi_note = base_note + input / 16;
+    }
+}
+
+// Runtime parameters
+// The event loop changes these per input while capture runs (-U). It keeps its own copy,
+// current, and hands a complete new set over in next; the capture thread applies the set
+// at the start of a buffer, so that a buffer never sees half a change. Only the ready flag
+// is shared, no lock, and the capture thread never waits for the event loop while it runs.
+// Once it stops, it waits for the event loop to let go of the device before freeing the
+// detectors and parameters; the event loop leaves a stopped device alone.
+typedef struct {
+    int trig_level;
+    int peak_frames, wait_frames;
+    int midi_channel, midi_note;
+} channel_params;
+
+typedef struct {
+    channel_params *current; // Event loop copy, one per input
+    channel_params *next; // Handed over to the capture thread
+    atomic_int ready; // Set by the event loop once next is complete, cleared by the capture thread once applied
+    atomic_int in_use; // Event loop working on the device
+    atomic_int stopped; // Detectors ended, set by the capture thread
+} param_block;
+
+// Capture devices
+// Each sound input (-D or -i) has its own capture thread, pinned to its own CPU if asked,
+// with its own sample format, channel count and detector state. Its channels are numbered
+// after those of the previous devices and its events go through its own queue, so that
+// inputs spread across cards and cores without an ALSA multi plugin in the way.
+typedef struct {
+    char *name; // ALSA device or file
+    int is_file;
+    int is_jack; // Detectors run in the JACK process callback, no capture thread
+    int channels; // Requested, then granted
+    int cpu; // -1 for no pinning
+    int realtime; // Run capture thread with SCHED_FIFO
+    int quiet; // No detector setup report, synthetic takes of -T and -W
+    int first_channel; // Global number of its first channel
+    audio_source source;
+    format_kernels kernels;
+    int max_sample_value;
+    event_queue queue;
+    timer_wheel wheel;
+    channel_table ch;
+    pthread_t thread;
+    long int bufcount; // Buffers processed
+    long long buffer_pos; // Frame position of current buffer in input stream, gaps included
+    int note_off_frames;
+    int detectors; // Channels in the detector table, channels times the compared methods
+    int use_planes; // Buffers are deinterleaved, otherwise only their peaks are needed
+    int velocity_shift; // Method 1, level to 7-bit velocity
+    float flux_decay; // Spectral flux average, per hop
+    int compare_window; // Frames, hits of two methods further apart are different hits
+    unsigned int xruns;
+    long long frames_lost;
+    float max_recovery_ms;
+    struct snapshot_queue *snapshots; // NULL unless recording (-R)
+    struct profile_stats *profile; // NULL unless profiling (-u)
+    param_block params;
+} capture_device;
+
+capture_device devices[max_devices];
+int device_count = 0;
+atomic_int devices_running = 0; // Capture threads not finished, the event loop runs until none is left
+sem_t device_ready; // Posted by each capture thread once its setup is printed
+pthread_barrier_t devices_start; // All devices start capturing together
+
+// Detection parameters, the same for all devices
+float trig_delay_ms = 0, wait_delay_ms = 0;
+float decay_rate_default = 0.98; // Per 128 frames
+float decay_factor_db = 6.0;
+float trigger_level_db = -30.0; // full range 0x7FFFFF / 0x7FFF = 256 ==> -48db = -6 * ln(256)/ln(2)
+#define trigger_level_min_db (-90.0) // Lowest -l, the trigger level of 16 bit inputs stays at least 1
+// ln(q)=G * ln(2)/-6 ==> q = exp(G * ln(2)/-6)
+float max_note_off_delay_ms = 250.0;
+int force_note_off = 0;
+int single_buffer = 0;
+#define max_method_list (256)
+int detect_methods[max_method_list] = {2}, detect_method_count = 1; // Per input, the last one for the rest
+// Early velocity: the note on is sent early_ms after the trigger, with a velocity predicted
+// from the peak so far, instead of at the end of the peak window
+float early_ms = 0; // 0 for off
+float early_gains[max_method_list] = {1.0};
+int early_gain_count = 1;
+int early_aftertouch = 0; // Send the velocity measured over the whole window as poly aftertouch
+// Compare mode: every input runs each method of the list, the first one plays
+#define max_compare (4)
+#define compare_window_ms (30)
+int compare_methods[max_compare], compare_count = 0; // 0 for off
+
+// Early velocity calibration, printed when a device stops, use the fitted gains with -E
+void print_calibration(capture_device *dev, int channels){
+    channel_table *ch = &dev->ch;
+    double gain;
+    int c;
+    for (c = 0; c < channels; c++){
+        if (!ch->cal_hits[c] || ch->cal_ee[c] == 0) continue;
+        gain = ch->cal_ep[c] / ch->cal_ee[c];
+        printf("input %d: %d early notes, gain %.3f velocity error %.1f, fitted gain %.3f velocity error %.1f\n",
+            dev->first_channel + c, ch->cal_hits[c],
+            ch->early_gain[c], calibration_error(ch, c, ch->early_gain[c], dev->max_sample_value),
+            gain, calibration_error(ch, c, gain, dev->max_sample_value));
+    }
+}
+
+// Detector engines
+// Each channel runs the engine of its method, chosen with -M. Every buffer, scan is called
+// for every channel and tells whether the buffer has work for it, e.g. a level above the
+// trigger level; run is then called for the busy channels and tells whether they are still
+// busy in the next buffer. A silent channel only costs its scan.
+typedef struct detector_engine {
+    int method; // -M number
+    const char *name;
+    int planes; // Scans the planar copy of the buffer, not only the peak of each input
+    void (*init)(capture_device *dev, int c); // Parameters are already set
+    void (*begin)(capture_device *dev, int c); // Before the buffer is scanned, may be NULL
+    void (*gap)(capture_device *dev, int c);
+    int (*scan)(capture_device *dev, int c);
+    int (*run)(capture_device *dev, int c, struct timespec *buffer_start);
+} detector_engine;
+
+// Snapshots
+// With -R, every input keeps its recent audio in a ring, a little longer than the window. A note on
+// opens a window from -L pre ms before its onset to post ms after it, further notes of the
+// input within the window (a double trigger) join it. Once the capture has passed the end
+// of the window, it is copied out of the ring into a slot of the queue of the device, and
+// the writer thread saves it as a mono WAV file with a text sidecar. The capture thread
+// only copies memory, a full queue drops the snapshot.
+// Windows start on a buffer boundary of the input stream: replayed with the same -b, a
+// clip is cut into buffers as it was live.
+#define snapshot_slots (16) // Per device, power of 2
+#define snapshot_max_notes (8)
+#define snapshot_writer_ms (20) // Writer thread polling period
+
+char *snapshot_dir = NULL; // NULL for off
+float snapshot_window_ms[2] = {20, 80}; // Before and after the onset
+
+typedef struct {
+    int input; // Channel of the device
+    long long onset, start; // Frame positions in the input stream
+    int frames; // 0 for none
+    int notes;
+    long long note_pos[snapshot_max_notes]; // Where each note on was decided
+    int velocity[snapshot_max_notes];
+    // Parameters of the detector when the window opened
+    int method, trig_level, peak_frames, wait_frames, trig_delay_buffers;
+    float decay_rate, decay_factor;
+    int *samples; // Of the slot, window frames
+} snapshot;
+
+typedef struct snapshot_queue {
+    snapshot slots[snapshot_slots];
+    atomic_uint head; // Next slot written by the capture thread
+    atomic_uint tail; // Next slot read by the writer thread
+    unsigned int dropped; // Snapshots lost because the queue was full
+    unsigned int written;
+    snapshot *pending; // One per input, waiting for the end of its window
+    int pending_count;
+    int window_frames;
+    int *ring; // ring_frames per input
+    int ring_frames; // Power of 2
+    long long valid_from; // Frame position of the first buffer after the last gap
+} snapshot_queue;
+
+atomic_int snapshot_stop = 0; // No more snapshots will come
+int write_wav(char *file_name, sample_format_info *fi, int channels, unsigned int sample_rate, int *samples, long long frames, int max_sample_value);
+
+// Before capture starts, the ring holds the window and the latest note on of method 1
+void open_snapshots(capture_device *dev){
+    snapshot_queue *q = channel_array(1, sizeof(snapshot_queue));
+    unsigned int sample_rate = dev->source.sample_rate;
+    int pre = roundf(snapshot_window_ms[0] * sample_rate / 1000);
+    int i;
+    q->window_frames = pre + buf_frames + roundf(snapshot_window_ms[1] * sample_rate / 1000);
+    for (q->ring_frames = 1; q->ring_frames < q->window_frames + 4 * buf_frames; q->ring_frames *= 2);
+    q->ring = channel_array(dev->channels * q->ring_frames, sizeof(int));
+    q->pending = channel_array(dev->channels, sizeof(snapshot));
+    for (i = 0; i < snapshot_slots; i++){
+        q->slots[i].samples = channel_array(q->window_frames, sizeof(int));
+    }
+    dev->snapshots = q;
+}
+
+void close_snapshots(capture_device *dev){
+    snapshot_queue *q = dev->snapshots;
+    int i;
+    for (i = 0; i < snapshot_slots; i++){
+        free(q->slots[i].samples);
+    }
+    free(q->ring);
+    free(q->pending);
+    free(q);
+    dev->snapshots = NULL;
+}
+
+// Copy the planes of the current buffer into the ring
+void snapshot_buffer(capture_device *dev){
+    snapshot_queue *q = dev->snapshots;
+    channel_table *ch = &dev->ch;
+    int offset = dev->buffer_pos & (q->ring_frames - 1);
+    int first = min(buf_frames, q->ring_frames - offset);
+    int *ring = q->ring;
+    int c;
+    for (c = 0; c < dev->channels; c++, ring += q->ring_frames){
+        memcpy(ring + offset, ch->planes + c * ch->plane_stride, first * sizeof(int));
+        memcpy(ring, ch->planes + c * ch->plane_stride + first, (buf_frames - first) * sizeof(int));
+    }
+}
+
+// Queue the pending snapshot of input c, with the frames captured before end
+void snapshot_push(capture_device *dev, int c, long long end){
+    snapshot_queue *q = dev->snapshots;
+    snapshot *s = &q->pending[c], *slot;
+    struct timespec pause = {0, 100000};
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    long long oldest = max(end - q->ring_frames + buf_frames - 1, q->valid_from) / buf_frames * buf_frames;
+    int *samples, *ring = q->ring + c * q->ring_frames;
+    int offset, first;
+
+    q->pending_count--;
+    while (head - atomic_load_explicit(&q->tail, memory_order_acquire) >= snapshot_slots){
+        if (!dev->queue.wait_when_full){
+            q->dropped++;
+            s->frames = 0;
+            return;
+        }
+        nanosleep(&pause, NULL);
+    }
+    slot = &q->slots[head & (snapshot_slots - 1)];
+    samples = slot->samples;
+    *slot = *s;
+    slot->samples = samples;
+    // What the ring still holds
+    slot->start = max(s->start, oldest);
+    slot->frames = max(min(s->start + s->frames, end) - slot->start, 0LL);
+    offset = slot->start & (q->ring_frames - 1);
+    first = min(slot->frames, q->ring_frames - offset);
+    memcpy(samples, ring + offset, first * sizeof(int));
+    memcpy(samples + first, ring, (slot->frames - first) * sizeof(int));
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    s->frames = 0;
+}
+
+// A note on of input c, frame position of its onset in ch->onset_pos
+void snapshot_note(capture_device *dev, int c, int velocity, long long pos){
+    snapshot_queue *q = dev->snapshots;
+    snapshot *s = &q->pending[c];
+    channel_table *ch = &dev->ch;
+    long long onset = ch->onset_pos[c];
+    long long pre = roundf(snapshot_window_ms[0] * dev->source.sample_rate / 1000);
+
+    if (s->frames && onset >= s->start + s->frames){
+        // The window of the previous hit is already captured
+        snapshot_push(dev, c, dev->buffer_pos + buf_frames);
+    }
+    if (!s->frames){
+        s->input = c;
+        s->onset = onset;
+        s->start = max(onset - pre, 0LL) / buf_frames * buf_frames;
+        s->frames = onset + roundf(snapshot_window_ms[1] * dev->source.sample_rate / 1000) - s->start;
+        s->notes = 0;
+        s->method = ch->engine[c]->method;
+        s->trig_level = ch->trig_level[c];
+        s->peak_frames = ch->peak_frames[c];
+        s->wait_frames = ch->wait_frames[c];
+        s->trig_delay_buffers = ch->trig_delay_buffers[c];
+        s->decay_rate = ch->decay_rate[c];
+        s->decay_factor = ch->decay_factor[c];
+        q->pending_count++;
+    }
+    if (s->notes < snapshot_max_notes){
+        s->note_pos[s->notes] = pos;
+        s->velocity[s->notes++] = velocity;
+    }
+}
+
+// After a buffer, queue the snapshots whose window it completed
+void snapshot_flush(capture_device *dev, long long end){
+    snapshot_queue *q = dev->snapshots;
+    int c;
+    for (c = 0; q->pending_count && c < dev->channels; c++){
+        if (q->pending[c].frames && q->pending[c].start + q->pending[c].frames <= end){
+            snapshot_push(dev, c, end);
+        }
+    }
+}
+
+// Capture stopped or has a gap, queue what was captured of the pending windows
+void snapshot_cut(capture_device *dev){
+    snapshot_queue *q = dev->snapshots;
+    int c;
+    for (c = 0; q->pending_count && c < dev->channels; c++){
+        if (q->pending[c].frames) snapshot_push(dev, c, dev->buffer_pos);
+    }
+}
+
+// Clip and sidecar of a snapshot, named after the input and the onset frame
+void snapshot_write(capture_device *dev, snapshot *s){
+    char name[PATH_MAX];
+    FILE *f;
+    unsigned int sample_rate = dev->source.sample_rate;
+    int input = dev->first_channel + s->input;
+    int i;
+
+    snprintf(name, sizeof(name), "%s/input%d_%lld.wav", snapshot_dir, input, s->onset);
+    if (write_wav(name, get_format_info(dev->source.format), 1, sample_rate, s->samples, s->frames, dev->max_sample_value)){
+        return;
+    }
+    snprintf(name, sizeof(name), "%s/input%d_%lld.txt", snapshot_dir, input, s->onset);
+    if ((f = fopen(name, "w")) == NULL){
+        fprintf (stderr, "cannot create %s (%s)\n", name, strerror(errno));
+        return;
+    }
+    fprintf(f, "device %s\n", dev->name);
+    fprintf(f, "input %d\n", input);
+    fprintf(f, "method %d\n", s->method);
+    fprintf(f, "sample_rate %u\n", sample_rate);
+    fprintf(f, "buffer_frames %d\n", buf_frames);
+    fprintf(f, "start_frame %lld\n", s->start);
+    fprintf(f, "onset_frame %lld (%.2f ms into the clip)\n", s->onset, (s->onset - s->start) * 1000.0 / sample_rate);
+    fprintf(f, "trigger_level %d (%.1f db)\n", s->trig_level, 20 * log10((double)s->trig_level / dev->max_sample_value));
+    if (s->method == 1){
+        fprintf(f, "retrigger_buffers %d\n", s->trig_delay_buffers);
+        fprintf(f, "decay_rate %f (per buffer)\n", s->decay_rate);
+        fprintf(f, "decay_factor %f\n", s->decay_factor);
+    }else{
+        fprintf(f, "peak_frames %d (%.2f ms)\n", s->peak_frames, s->peak_frames * 1000.0 / sample_rate);
+        fprintf(f, "wait_frames %d (%.2f ms)\n", s->wait_frames, s->wait_frames * 1000.0 / sample_rate);
+    }
+    // Frame where each note on was decided, velocity
+    for (i = 0; i < s->notes; i++){
+        fprintf(f, "note %lld %d\n", s->note_pos[i], s->velocity[i]);
+    }
+    fclose(f);
+}
+
+// Writer thread, saves the snapshots queued by all devices
+void *snapshot_writer(void *arg){
+    struct timespec pause = {0, snapshot_writer_ms * 1000000};
+    snapshot_queue *q;
+    unsigned int tail;
+    int i, idle, stop;
+    do{
+        stop = atomic_load(&snapshot_stop); // Checked before the last pass
+        idle = 1;
+        for (i = 0; i < device_count; i++){
+            if ((q = devices[i].snapshots) == NULL) continue;
+            tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+            while (tail != atomic_load_explicit(&q->head, memory_order_acquire)){
+                snapshot_write(&devices[i], &q->slots[tail & (snapshot_slots - 1)]);
+                q->written++;
+                atomic_store_explicit(&q->tail, ++tail, memory_order_release);
+                idle = 0;
+            }
+        }
+        if (idle && !stop) nanosleep(&pause, NULL);
+    }while (!stop);
+    return NULL;
+}
+
+// Compare mode
+// Channel c of the detector table runs method c / channels on input c % channels. A hit of
+// an other method is paired with the hit of the first method on the same input when they
+// are less than compare_window_ms apart, whichever comes first.
+void compare_pair(capture_device *dev, int first_c, int c){
+    channel_table *ch = &dev->ch;
+    long long delay = ch->cmp_pos[c] - ch->cmp_pos[first_c];
+    int vdiff = ch->cmp_velocity[c] - ch->cmp_velocity[first_c];
+    ch->cmp_open[first_c] &= ~(1 << (c / dev->channels));
+    ch->cmp_open[c] = 0;
+    ch->cmp_matched[c]++;
+    ch->cmp_delay[c] += delay;
+    if (llabs(delay) > llabs(ch->cmp_delay_max[c])) ch->cmp_delay_max[c] = delay;
+    ch->cmp_vdiff[c] += vdiff;
+    ch->cmp_vsq[c] += vdiff * vdiff;
+    // Short enough for a log event
+    log_event("compare input %d method %d: %+.2f ms, velocity %+d\n",
+        dev->first_channel + first_c, ch->engine[c]->method, delay * 1000.0 / dev->source.sample_rate, vdiff);
+}
+
+void compare_hit(capture_device *dev, int c, int velocity, long long pos){
+    channel_table *ch = &dev->ch;
+    int first_c = c % dev->channels, m = c / dev->channels, other;
+    ch->cmp_pos[c] = pos;
+    ch->cmp_velocity[c] = velocity;
+    ch->cmp_hits[c]++;
+    if (m == 0){
+        ch->cmp_open[c] = 0;
+        for (m = 1; m < compare_count; m++){
+            other = m * dev->channels + c;
+            if (ch->cmp_open[other] && pos - ch->cmp_pos[other] <= dev->compare_window){
+                compare_pair(dev, c, other);
+            }else{
+                ch->cmp_open[c] |= 1 << m;
+            }
+        }
+    }else{
+        ch->cmp_open[c] = 1;
+        if ((ch->cmp_open[first_c] & (1 << m)) && pos - ch->cmp_pos[first_c] <= dev->compare_window){
+            compare_pair(dev, first_c, c);
+        }
+    }
+}
+
+// Hits, pairs and mean differences of each method against the first one, per input
+void print_compare(capture_device *dev){
+    channel_table *ch = &dev->ch;
+    float ms_per_frame = 1000.0 / dev->source.sample_rate;
+    int c, m, matched;
+    for (c = 0; c < dev->channels; c++){
+        for (m = 1; m < compare_count; m++){
+            matched = ch->cmp_matched[m * dev->channels + c];
+            printf("input %d: method %d %d hits, method %d %d hits, %d matched",
+                dev->first_channel + c, compare_methods[0], ch->cmp_hits[c],
+                compare_methods[m], ch->cmp_hits[m * dev->channels + c], matched);
+            if (matched){
+                printf(", delay %+.2f ms (max %+.2f) velocity %+.1f (rms %.1f)",
+                    (float)ch->cmp_delay[m * dev->channels + c] / matched * ms_per_frame,
+                    ch->cmp_delay_max[m * dev->channels + c] * ms_per_frame,
+                    (float)ch->cmp_vdiff[m * dev->channels + c] / matched,
+                    sqrt((double)ch->cmp_vsq[m * dev->channels + c] / matched));
+            }
+            printf("\n");
+        }
+    }
+}
+
+// A detector decided a note on at frame pos of the input stream
+// In compare mode only the channels of the first method play, the others are only compared
+// Detector setup report of a device, unless it is quiet
+void setup_printf(capture_device *dev, const char *format, ...){
+    va_list args;
+    if (dev->quiet) return;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+void detector_note_on(capture_device *dev, int c, int velocity, long long pos){
+    channel_table *ch = &dev->ch;
+    if (compare_count) compare_hit(dev, c, velocity, pos);
+    if (c >= dev->channels) return;
+    if (force_note_off && timer_pending(&ch->note_off_timer[c])){
+        send_note_off(dev->first_channel + c, ch->midi_channel[c], ch->midi_note[c], &ch->onset_time[c]);
+#ifdef debug
+        fprintf (stderr, "\nX %u %lu ", c, dev->bufcount);
+#endif
+    }
+    send_note_on(dev->first_channel + c, ch->midi_channel[c], ch->midi_note[c], velocity, &ch->onset_time[c]);
+    ch->last_velocity[c] = velocity;
+    ch->note_count[c]++;
+    if (dev->snapshots) snapshot_note(dev, c, velocity, pos);
+    timer_schedule(&dev->wheel, &ch->note_off_timer[c], pos + dev->note_off_frames);
+}
+
+// Method 1
+// React to peak in current, previous and before previous buffer
+// Will wait actual decay before sending, i.e. max_l < previous_max_l
+// test showed max rising for 4 buffers at 44100Hz, 64 frames per buffer (~6ms)
+// 6ms max reaction time should be ok when playing
+void envelope_init(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    // State variables
+    ch->rising[c] = 0; // Not rising
+    ch->decay[c] = 0.0;
+    ch->waiting[c] = 0; // Not waiting
+    ch->max_l[c] = 0;
+    ch->previous_max_l[c] = 0;
+    ch->previous_previous_max_l[c] = 0;
+}
+
+void envelope_begin(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    ch->previous_previous_max_l[c] = ch->previous_max_l[c];
+    ch->previous_max_l[c] = ch->max_l[c];
+    ch->max_l[c] = 0; // l for level (always positive)
+    ch->previous_previous_max_v[c] = ch->previous_max_v[c];
+    // 7 MSB; -1 in case previous_max_l is 0x800000 (abs(-0x800000))
+    ch->previous_max_v[c] = (ch->previous_max_l[c] - 1) >> dev->velocity_shift;
+    //~ max_d[c] = 0; // d for difference (always positive) // FIXME use previous[c]
+}
+
+void envelope_gap(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    ch->rising[c] = 0;
+    ch->previous_max_l[c] = ch->previous_previous_max_l[c] = 0;
+}
+
+int envelope_scan(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    if (dev->use_planes) ch->max_l[c] = ch->plane_peak[c % dev->channels];
+    // Silent, nothing to update
+    return ch->rising[c] || ch->waiting[c] || ch->decay[c] != 0.0 || ch->max_l[c] > ch->trig_level[c];
+}
+
+int envelope_run(capture_device *dev, int c, struct timespec *buffer_start){
+    channel_table *ch = &dev->ch;
+    if (ch->rising[c]){ // Trigger detected in previous buffer
+        ch->rising[c]++; // For stats; should we set a limit?
+#ifdef debug
+        //~ fprintf (stderr, "r");
+#endif
+        // Requiring 2 consecutive falling buffers can audibly increase latency
+        if ((ch->max_l[c] < ch->previous_max_l[c]) && (single_buffer || (ch->previous_max_l[c] < ch->previous_previous_max_l[c]))){
+#ifdef debug
+            fprintf (stderr, "f %u ", ch->rising[c]);
+#endif
+            ch->rising[c] = 0; // no longer rising
+            ch->waiting[c] = ch->trig_delay_buffers[c]; // Start or restart wait period
+            //~ ch->decay[c] = (float)(ch->previous_max_l[c] - ch->trig_level[c]) * ch->decay_factor[c]; // ... and envelope
+            ch->decay[c] = (float)(ch->previous_previous_max_l[c] - ch->trig_level[c]) * ch->decay_factor[c]; // ... and envelope
+            // Prepare to send a note off after a certain number of frames
+            // could make it depend on hit strength?
+#ifdef debug
+            fprintf (stderr, "\nI %u %d %lu ", c, timer_pending(&ch->note_off_timer[c]), dev->bufcount);
+#endif
+            // Note is sent at the end of this buffer
+            //~ send_note_on(ch->midi_channel[c], ch->midi_note[c], ch->previous_max_v[c]);
+            detector_note_on(dev, c, ch->previous_previous_max_v[c], dev->buffer_pos + buf_frames);
+#ifdef debug
+            fprintf (stderr, "\n! %u %d %lu ", c, ch->previous_previous_max_v[c], dev->bufcount);
+#endif
+        }
+    }else if (ch->waiting[c]){
+        ch->waiting[c]--;
+#ifdef debug
+        fprintf (stderr, "w %u", c);
+#endif
+    }else{ // Decaying, ready for trigger
+        if (ch->max_l[c] > (ch->trig_level[c] + ch->decay[c])){ // Trigger found in this buffer
+            ch->rising[c] = 1;
+            ch->onset_time[c] = *buffer_start; // Somewhere in this buffer
+            ch->onset_pos[c] = dev->buffer_pos;
+        }
+        if (ch->decay[c] < 1.0){
+#ifdef debug
+            //~ fprintf (stderr,".");
+#endif
+            ch->decay[c] = 0.0;
+        }else{
+#ifdef debug
+            //~ fprintf (stderr, "d");
+            //~ fprintf (stderr, "d %u %f\n", c, ch->decay[c]);
+#endif
+            ch->decay[c] *= ch->decay_rate[c];
+        }
+    }
+    return 0; // Scanned again in the next buffer
+}
+
+// Method 2
+// Looking for peak can span multiple buffers
+// timing  should be sample-accurate but midi isn't!
+void peak_init(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    setup_printf(dev, "channel %u peak window %u frames retrigger inhibit %u frames\n", c % dev->channels, ch->peak_frames[c], ch->wait_frames[c]);
+    ch->state[c]=STATE_IDLE;
+    ch->old_state[c]=STATE_UNKNOWN;
+    timer_init(&ch->retrigger_timer[c], TIMER_RETRIGGER, c);
+    ch->start_frame[c] = 0;
+    if (ch->early_frames[c] && ch->early_frames[c] < ch->peak_frames[c]){
+        setup_printf(dev, "channel %u early note on after %u frames, peak gain %f\n", c % dev->channels, ch->early_frames[c], ch->early_gain[c]);
+    }
+}
+
+void peak_gap(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    if (ch->state[c] == STATE_PEAK) ch->state[c] = STATE_IDLE;
+    ch->start_frame[c] = 0;
+    ch->early_count[c] = ch->early_velocity[c] = 0;
+}
+
+// Idle channels whose level crossed the trigger level somewhere in the buffer have work,
+// waiting ones are woken by their retrigger timer
+int peak_scan(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    if (ch->state[c] != STATE_IDLE) return 0;
+    if (ch->plane_peak[c % dev->channels] > ch->trig_level[c]) return 1;
+    ch->start_frame[c] = 0;
+    return 0;
+}
+
+int peak_run(capture_device *dev, int c, struct timespec *buffer_start){
+    channel_table *ch = &dev->ch;
+    int remaining_frames; // Remaining in current buffer
+    int trig_frame, span, frame;
+    int velocity;
+    int * buf_tail;
+
+    // Should have a loop to handle tail of buffer
+    remaining_frames = buf_frames - ch->start_frame[c];
+    buf_tail = ch->planes + c % dev->channels * ch->plane_stride + ch->start_frame[c];
+    ch->start_frame[c] = 0;
+    // Sate will not necessarily extend to end of buffer,
+    // we need to loop over buffer chunks.
+    while (remaining_frames>0) {
+#ifdef debug					
+        if (ch->state[c]!=ch->old_state[c]){
+            // fprintf (stderr, "%c %u %u->", state_names[ch->old_state[c]][0], c, remaining_frames);
+            fprintf (stderr, "%c %u %u ", state_names[ch->state[c]][0], c, remaining_frames);
+            ch->old_state[c]=ch->state[c];
+        }
+#endif					
+        switch (ch->state[c]){
+            case STATE_IDLE:
+                // Look if trigger level is reached
+                if (ch->engine[c]->method == 3){
+                    trig_frame = find_flux_trig(&ch->flux_onsets[c], ch->flux_first_end[c], buf_frames - remaining_frames);
+                }else{
+                    trig_frame=find_channel_trig(buf_tail, remaining_frames, ch->trig_level[c]);
+                }
+                if (trig_frame>=0){  // Trigger level was reached
+                    frame_time(&ch->onset_time[c], buffer_start, buf_frames - remaining_frames + trig_frame, dev->source.sample_rate);
+                    ch->onset_pos[c] = dev->buffer_pos + buf_frames - remaining_frames + trig_frame;
+                    buf_tail += trig_frame+1;
+                    remaining_frames -= trig_frame+1;
+#ifdef debug
+                    fprintf (stderr, "t%u r%u ", trig_frame, remaining_frames);
+#endif								
+                    // prepare for next stage
+                    ch->state[c] = STATE_PEAK;
+                    ch->peak_level[c] = ch->trig_level[c];
+                    ch->frame_count[c] = ch->peak_frames[c];
+                    ch->early_count[c] = ch->early_frames[c] < ch->peak_frames[c] ? ch->early_frames[c] : 0;
+                }else{ // Trigger level was not reached in this buffer
+                    remaining_frames = 0; // Maybe in next buffer...
+                    // State stays STATE_IDLE
+                }
+                break;
+            case STATE_PEAK:
+                // look for peak within allowed time frame
+                // in early mode, stop first where the note on is due
+                span = min(remaining_frames, ch->frame_count[c]);
+                if (ch->early_count[c]) span = min(span, ch->early_count[c]);
+                find_channel_peak(buf_tail, span, &ch->peak_level[c]);
+                ch->frame_count[c] -= span;
+                buf_tail += span;
+                remaining_frames -= span;
+                frame = buf_frames - remaining_frames;
+                if (ch->early_count[c] && (ch->early_count[c] -= span) == 0){
+                    // Early note on, the peak window goes on for the correction
+                    // The predicted peak can be below the trigger level, a velocity of 0 would be a note off
+                    velocity = peak_velocity(min(ch->peak_level[c] * ch->early_gain[c], (float)dev->max_sample_value), ch->trig_level[c], dev->max_sample_value);
+                    velocity = max(velocity, 1);
+                    ch->early_velocity[c] = velocity;
+                    ch->early_peak[c] = ch->peak_level[c];
+                    detector_note_on(dev, c, velocity, dev->buffer_pos + frame);
+                }
+                if (ch->frame_count[c]<=0){ // Is end of peak measurement window reached?
+                    velocity = peak_velocity(ch->peak_level[c], ch->trig_level[c], dev->max_sample_value);
+#ifdef debug								
+                    fprintf (stderr, "p:%u v:%u\n", ch->peak_level[c], velocity);
+#endif								
+                    if (ch->early_velocity[c]){
+                        calibration_add(ch, c);
+                        if (early_aftertouch && velocity != ch->early_velocity[c] && c < dev->channels){
+                            send_aftertouch(dev->first_channel + c, ch->midi_channel[c], ch->midi_note[c], velocity, &ch->onset_time[c]);
+                        }
+                        ch->early_velocity[c] = 0;
+                    }else{
+                        // Send MIDI note
+                        // Note off and retrigger inhibit count from the end of the peak window
+                        // FIXME should be from actual peak frame
+                        // but this is not necessarily in the current buffer
+                        detector_note_on(dev, c, velocity, dev->buffer_pos + frame);
+                    }
+                    if (frame + ch->wait_frames[c] < buf_frames){ // Inhibit ends in this buffer
+                        buf_tail += ch->wait_frames[c];
+                        remaining_frames -= ch->wait_frames[c];
+                        ch->state[c] = STATE_IDLE;
+                    }else{
+                        timer_schedule(&dev->wheel, &ch->retrigger_timer[c], dev->buffer_pos + frame + ch->wait_frames[c]);
+                        ch->state[c] = STATE_WAIT;
+                    }
+#ifdef debug
+                }else{
+                    fprintf (stderr, "p");
+#endif
+                }
+                break;
+            default: // case STATE_WAIT:
+                // do nothing until retrigger timer expires
+#ifdef debug
+                fprintf (stderr, "w");
+#endif
+                remaining_frames = 0;
+                break;
+        } // End of switch
+    } // End of while buffer chunk loop
+    return ch->state[c] == STATE_PEAK;
+}
+
+// Method 3
+// Same state machine as method 2, the trigger is an onset of the spectral flux. Flux
+// inputs look for onsets in every buffer, whatever their state, the flux compares each
+// hop with the previous one. A quiet input is reset once and skipped.
+void flux_channel_init(capture_device *dev, int c){
+    peak_init(dev, c);
+    setup_printf(dev, "channel %u spectral flux onsets, %u frames per hop\n", c % dev->channels, flux_hop);
+}
+
+int flux_channel_scan(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    int input = c % dev->channels;
+    ch->flux_onsets[c] = 0;
+    if (ch->plane_peak[input] <= ch->trig_level[c] / 8){
+        if (!ch->flux_quiet[c]){
+            memset(ch->flux_history + c * flux_size, 0, flux_size * sizeof(float));
+            memset(ch->flux_mag + c * flux_size, 0, flux_size * sizeof(float));
+            ch->flux_mean[c] = 0;
+            ch->flux_fill[c] = 0;
+            ch->flux_quiet[c] = 1;
+        }
+    }else{
+        ch->flux_quiet[c] = 0;
+        ch->flux_onsets[c] = flux_scan(ch->planes + input * ch->plane_stride, buf_frames,
+            ch->flux_history + c * flux_size, ch->flux_mag + c * flux_size, &ch->flux_fill[c],
+            &ch->flux_mean[c], dev->flux_decay, ch->trig_level[c], &ch->flux_first_end[c]);
+    }
+    if (ch->state[c] != STATE_IDLE) return 0;
+    if (ch->flux_onsets[c]) return 1;
+    ch->start_frame[c] = 0;
+    return 0;
+}
+
+const detector_engine detector_engines[] = {
+    {1, "envelope", 0, envelope_init, envelope_begin, envelope_gap, envelope_scan, envelope_run},
+    {2, "amplitude", 1, peak_init, NULL, peak_gap, peak_scan, peak_run},
+    {3, "spectral flux", 1, flux_channel_init, NULL, peak_gap, flux_channel_scan, peak_run},
+    {0}
+};
+
+const detector_engine *get_engine(int method){
+    const detector_engine *e;
+    for(e = detector_engines; e->method && e->method != method; e++);
+    return e->method ? e : NULL;
+}
+
+// State of detector c for meters and profiles, a meter_state
+int channel_state(capture_device *dev, int c){
+    channel_table *ch = &dev->ch;
+    if (ch->engine[c]->method == 1){
+        return ch->rising[c] ? METER_RISING : ch->waiting[c] ? METER_WAIT : ch->decay[c] != 0.0 ? METER_DECAY : METER_IDLE;
+    }
+    return ch->state[c] == STATE_PEAK ? METER_PEAK : ch->state[c] == STATE_WAIT ? METER_WAIT : METER_IDLE;
+}
+
+// Profile
+// With -u, every buffer is timed with CLOCK_MONOTONIC_RAW in three stages: the format
+// scan (deinterleave or peak kernels, from detector_begin on), the detectors (timers, state
+// machines, snapshots) and the MIDI hand-over to the output thread or JACK port. Each is
+// counted as a share of the buffer duration, the time the capture thread has before the
+// next buffer is due. Waiting for the sound input is not counted. At exit, the minimum,
+// mean, maximum and 99.9th percentile load of each stage are printed, with the worst buffers
+// and the state of every channel at their end.
+#define profile_bins (2000) // 0.1% of the buffer duration each, the last one counts longer
+#define profile_worst (5)
+
+typedef enum {
+    STAGE_SCAN,
+    STAGE_DETECT,
+    STAGE_MIDI,
+    STAGE_TOTAL, // Including the meters
+    STAGE_COUNT
+} Stage;
+const char * stage_names[] = {"scan", "detect", "midi", "total"};
+
+typedef struct {
+    long int bufcount; // 0 for none
+    long long ns[STAGE_COUNT];
+    int busy; // Detectors run
+    char *states; // Letter of the meter_state of each channel
+} profile_period;
+
+typedef struct profile_stats {
+    double buffer_ns; // Duration of a buffer, the deadline
+    struct timespec t; // Last timestamp
+    long long ns[STAGE_COUNT]; // Of the current buffer
+    long long min_ns[STAGE_COUNT], max_ns[STAGE_COUNT];
+    double sum_ns[STAGE_COUNT];
+    unsigned int bins[STAGE_COUNT][profile_bins];
+    long int periods;
+    profile_period worst[profile_worst]; // Longest total first
+} profile_stats;
+
+int profiling = 0;
+const char profile_state_letters[] = "IPWRD"; // meter_state
+
+void open_profile(capture_device *dev){
+    profile_stats *p = channel_array(1, sizeof(profile_stats));
+    int i;
+    p->buffer_ns = buf_frames * 1e9 / dev->source.sample_rate;
+    for (i = 0; i < STAGE_COUNT; i++) p->min_ns[i] = LLONG_MAX;
+    for (i = 0; i < profile_worst; i++){
+        p->worst[i].states = channel_array(dev->channels + 1, 1);
+    }
+    dev->profile = p;
+}
+
+// Time since the last mark, added to stage
+static inline void profile_mark(profile_stats *p, Stage stage){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    p->ns[stage] += timespec_diff_ns(&t, &p->t);
+    p->t = t;
+}
+
+// At the end of a buffer, add its stages to the statistics
+void profile_period_end(capture_device *dev, int busy){
+    profile_stats *p = dev->profile;
+    profile_period *w;
+    char *states;
+    int i, c;
+    p->ns[STAGE_TOTAL] += p->ns[STAGE_SCAN] + p->ns[STAGE_DETECT] + p->ns[STAGE_MIDI];
+    for (i = 0; i < STAGE_COUNT; i++){
+        p->min_ns[i] = min(p->min_ns[i], p->ns[i]);
+        p->max_ns[i] = max(p->max_ns[i], p->ns[i]);
+        p->sum_ns[i] += p->ns[i];
+        p->bins[i][min((int)(p->ns[i] * 1000 / p->buffer_ns), profile_bins - 1)]++;
+    }
+    p->periods++;
+    // Only a new worst buffer costs more than a few additions
+    if (p->ns[STAGE_TOTAL] > p->worst[profile_worst - 1].ns[STAGE_TOTAL]){
+        for (i = profile_worst - 1; i > 0 && p->ns[STAGE_TOTAL] > p->worst[i - 1].ns[STAGE_TOTAL]; i--);
+        states = p->worst[profile_worst - 1].states; // Recycled
+        memmove(&p->worst[i + 1], &p->worst[i], (profile_worst - 1 - i) * sizeof(profile_period));
+        w = &p->worst[i];
+        w->states = states;
+        w->bufcount = dev->bufcount;
+        memcpy(w->ns, p->ns, sizeof(p->ns));
+        w->busy = busy;
+        for (c = 0; c < dev->channels; c++){
+            w->states[c] = profile_state_letters[channel_state(dev, c)];
+        }
+    }
+}
+
+// Load at percentile q of a stage, share of the buffer duration
+float profile_percentile(profile_stats *p, Stage stage, double q){
+    long int count = 0, rank = ceil(p->periods * q);
+    int i;
+    for (i = 0; i < profile_bins - 1 && (count += p->bins[stage][i]) < rank; i++);
+    return (i + 1) / 1000.0;
+}
+
+void print_profile(capture_device *dev){
+    profile_stats *p = dev->profile;
+    profile_period *w;
+    int i;
+    if (!p->periods) return;
+    printf("%s: DSP load over %ld buffers of %.3f ms, %% of the buffer duration\n", dev->name, p->periods, p->buffer_ns / 1e6);
+    printf("stage         min      avg      max   p99.9\n");
+    for (i = 0; i < STAGE_COUNT; i++){
+        printf("%-8s %8.2f %8.2f %8.2f %7.1f\n", stage_names[i],
+            p->min_ns[i] * 100 / p->buffer_ns, p->sum_ns[i] / p->periods * 100 / p->buffer_ns,
+            p->max_ns[i] * 100 / p->buffer_ns, profile_percentile(p, i, 0.999) * 100);
+    }
+    printf("worst buffers, detectors run, channel states I idle P peak W wait R rising D decay:\n");
+    for (i = 0; i < profile_worst && p->worst[i].bufcount; i++){
+        w = &p->worst[i];
+        printf("buffer %ld: %.2f%% (scan %.2f detect %.2f midi %.2f), %d run %s\n", w->bufcount,
+            w->ns[STAGE_TOTAL] * 100 / p->buffer_ns, w->ns[STAGE_SCAN] * 100 / p->buffer_ns,
+            w->ns[STAGE_DETECT] * 100 / p->buffer_ns, w->ns[STAGE_MIDI] * 100 / p->buffer_ns, w->busy, w->states);
+    }
+}
+
+void close_profile(capture_device *dev){
+    int i;
+    for (i = 0; i < profile_worst; i++){
+        free(dev->profile->worst[i].states);
+    }
+    free(dev->profile);
+    dev->profile = NULL;
+}
+
+// Detector setup of a device, before its first buffer
+void detector_init(capture_device *dev){
+    audio_source *src = &dev->source;
+    int channels = dev->channels;
+    int first = dev->first_channel;
+    unsigned int sample_rate = src->sample_rate;
+    int trig_delay_frames_default, trig_delay_buffers_default;
+    int wait_delay_frames_default, wait_delay_buffers_default;
+    float decay_rate_buffer;
+    float decay_factor_default;
+    int trig_level_default;
+    int c, input, method, methods_used = 0;
+    channel_table *ch = &dev->ch;
+
+    // Tested values ok for 128 frames:
+    // trig_delay_buffers = 4, decay_rate = 0.98, decay_factor = 2.0
+    // 4 x 128 frames at 44100 Hz = 11.6 ms
+    // T = 1/ln(0.98) = 49 buffers
+    dev->detectors = channels * max(compare_count, 1);
+    channel_table_alloc(ch, dev->detectors, channels);
+    dev->use_planes = compare_count > 0 || dev->snapshots; // Snapshots record the planes
+    if (profiling) open_profile(dev);
+    for(dev->velocity_shift = 0; (dev->max_sample_value >> dev->velocity_shift) > 127; dev->velocity_shift++);
+    decay_factor_default = exp(decay_factor_db* log(2)/6.0);
+    // -d is given per 128 frames, keep the same decay time with other buffer sizes
+    decay_rate_buffer = pow(decay_rate_default, (double)buf_frames / reference_buf_frames);
+    dev->flux_decay = exp(-flux_hop / (flux_mean_ms * sample_rate / 1000.0)); // Per hop
+    dev->compare_window = roundf(compare_window_ms * sample_rate / 1000.0);
+    for(c = 0; c < dev->detectors; c++){
+        input = c % channels;
+        method = compare_count ? compare_methods[c / channels] : detect_methods[min(first + input, detect_method_count - 1)];
+        ch->engine[c] = get_engine(method);
+        dev->use_planes |= ch->engine[c]->planes;
+        methods_used |= 1 << method;
+    }
+    if (methods_used & 1 << 1){
+        setup_printf(dev, "decay initial factor %f db, value %f\n", decay_factor_db, decay_factor_default);
+        setup_printf(dev, "decay per buffer: %f\n", decay_rate_buffer);
+    }
+	
+    float ms_per_buffer;
+    
+    ms_per_buffer = (buf_frames * 1000.0)/(float)sample_rate;
+    trig_delay_frames_default = roundf(trig_delay_ms * sample_rate) / 1000;
+    trig_delay_buffers_default = trig_delay_frames_default / buf_frames;
+    wait_delay_frames_default = roundf(wait_delay_ms * sample_rate) / 1000;
+    wait_delay_buffers_default = wait_delay_frames_default / buf_frames;
+    trig_level_default = dev->max_sample_value / exp(trigger_level_db * log(2)/-6.0); // FIXME must check >0 !!
+    setup_printf(dev, "trigger level %f db factor %u, value %u\n", trigger_level_db, (int)(exp(trigger_level_db * log(2)/-6.0)), trig_level_default);
+
+    dev->note_off_frames = roundf(max_note_off_delay_ms * sample_rate / 1000);
+    setup_printf(dev, "note off delay %u frames (%f ms)\n", dev->note_off_frames, dev->note_off_frames * 1000.0 / sample_rate);
+
+    setup_printf(dev, "buffer length: %u frames (%u bytes)\n", buf_frames, buf_frames * src->frame_bytes);
+    setup_printf(dev, "time per buffer: %f ms\n", ms_per_buffer);
+    setup_printf(dev, "re-trigger delay (buffers): %u (%f ms)\n",
+        trig_delay_buffers_default,
+        trig_delay_buffers_default * ms_per_buffer
+        );
+    setup_printf(dev, "re-trigger delay (frames): %u (%f ms)\n",
+        trig_delay_frames_default,
+        (float)trig_delay_frames_default * 1000 / sample_rate
+        );
+    if (!dev->is_file && !dev->is_jack){
+        setup_printf(dev, "sound input buffer: %lu frames (%lu periods, %f ms)\n",
+            src->buffer_frames, src->buffer_frames / src->period_frames,
+            src->buffer_frames * 1000.0 / sample_rate);
+    }
+    // A hit is only seen once its buffer is complete, then the detector has to wait
+    // for the peak window (method 2) or for falling buffers (method 1)
+    if (methods_used & 1 << 1){
+        setup_printf(dev, "estimated onset to MIDI latency, method 1: %f..%f ms\n",
+            ms_per_buffer * (single_buffer ? 1 : 2),
+            ms_per_buffer * (single_buffer ? 2 : 3));
+    }
+    if (methods_used & (1 << 2 | 1 << 3)){
+        setup_printf(dev, "estimated onset to MIDI latency: %f..%f ms\n",
+            (float)trig_delay_frames_default * 1000 / sample_rate,
+            (float)trig_delay_frames_default * 1000 / sample_rate + ms_per_buffer);
+    }
+    if (compare_count){
+        setup_printf(dev, "comparing methods");
+        for(c = 0; c < compare_count; c++) setup_printf(dev, " %d", compare_methods[c]);
+        setup_printf(dev, ", method %d plays\n", compare_methods[0]);
+    }
+
+    for(c = 0; c < dev->detectors; c++){
+        input = c % channels;
+        // Parameters
+        // FIXME set through command line or other (config file? OSC? midi in?)
+        // FIXME make parameter decay independant of frame size and sample rate
+        // FIXME use sensible units
+        ch->trig_level[c] = trig_level_default;
+        map_input(first + input, &ch->midi_channel[c], &ch->midi_note[c]);
+        if (c < channels){
+            setup_printf(dev, "channel %u trigger level %u midi channel %u note %u\n", c, ch->trig_level[c], ch->midi_channel[c] + 1, ch->midi_note[c]);
+        }
+        ch->trig_delay_buffers[c] = trig_delay_buffers_default;
+        ch->decay_rate[c] = decay_rate_buffer;
+        ch->decay_factor[c] = decay_factor_default; // Should this depend on sample #?
+        ch->wait_frames[c] = wait_delay_frames_default;
+        ch->peak_frames[c] = trig_delay_frames_default;
+        if (early_ms > 0){
+            ch->early_frames[c] = max(roundf(early_ms * sample_rate / 1000), 1.0f);
+            ch->early_gain[c] = early_gains[min(first + input, early_gain_count - 1)];
+        }
+        timer_init(&ch->note_off_timer[c], TIMER_NOTE_OFF, c); // No pending note
+        ch->engine[c]->init(dev, c);
+        //~ previous[c] = 0;
+        //~ max_d[c] = 0;
+        
+    }
+    dev->params.current = channel_array(channels, sizeof(channel_params));
+    dev->params.next = channel_array(channels, sizeof(channel_params));
+    for(c = 0; c < channels; c++){
+        dev->params.current[c].trig_level = ch->trig_level[c];
+        dev->params.current[c].peak_frames = ch->peak_frames[c];
+        dev->params.current[c].wait_frames = ch->wait_frames[c];
+        dev->params.current[c].midi_channel = ch->midi_channel[c];
+        dev->params.current[c].midi_note = ch->midi_note[c];
+    }
+}
+
+// Start of a buffer, apply the parameters handed over by the event loop to every
+// detector of each input
+void apply_params(capture_device *dev){
+    channel_table *ch = &dev->ch;
+    channel_params *p;
+    int c;
+    for(c = 0; c < dev->detectors; c++){
+        p = &dev->params.next[c % dev->channels];
+        if ((p->midi_channel != ch->midi_channel[c] || p->midi_note != ch->midi_note[c]) && timer_pending(&ch->note_off_timer[c])){
+            // Its note off would go to the new note
+            send_note_off(dev->first_channel + c, ch->midi_channel[c], ch->midi_note[c], &capture_time);
+            timer_cancel(&ch->note_off_timer[c]);
+        }
+        ch->trig_level[c] = p->trig_level;
+        ch->peak_frames[c] = p->peak_frames;
+        ch->wait_frames[c] = p->wait_frames;
+        ch->midi_channel[c] = p->midi_channel;
+        ch->midi_note[c] = p->midi_note;
+    }
+    atomic_store_explicit(&dev->params.ready, 0, memory_order_release);
+}
+
+// Before a buffer is scanned
+void detector_begin(capture_device *dev){
+    channel_table *ch = &dev->ch;
+    int c;
+    if (dev->profile){
+        memset(dev->profile->ns, 0, sizeof(dev->profile->ns));
+        clock_gettime(CLOCK_MONOTONIC_RAW, &dev->profile->t);
+    }
+    if (atomic_load_explicit(&dev->params.ready, memory_order_acquire)) apply_params(dev);
+    for(c = 0; c < dev->detectors; c++){
+        if (ch->engine[c]->begin) ch->engine[c]->begin(dev, c);
+    }
+    if (dev->use_planes) memset(ch->plane_peak, 0, dev->channels * sizeof(int));
+    if (dev->profile) profile_mark(dev->profile, STAGE_SCAN);
+}
+
+// Capture restarted after a time discontinuity of gap_frames
+// Timers due in the gap expire with the next buffer, hits cut by the gap are dropped
+void detector_gap(capture_device *dev, long long gap_frames){
+    channel_table *ch = &dev->ch;
+    int c;
+    dev->frames_lost += gap_frames;
+    if (dev->snapshots) snapshot_cut(dev);
+    dev->buffer_pos += (gap_frames + buf_frames - 1) / buf_frames * buf_frames; // Keep buffers aligned on wheel slots
+    if (dev->snapshots) dev->snapshots->valid_from = dev->buffer_pos;
+    for(c = 0; c < dev->detectors; c++){
+        ch->engine[c]->gap(dev, c);
+    }
+    memset(ch->busy, 0, mask_words(dev->detectors) * sizeof(unsigned long long));
+}
+
+// Format-dependant scan of channel_count interleaved inputs from input c, frames on in the buffer
+// Method 1 alone only needs the peak of each input, the others need the planes
+void detector_scan(capture_device *dev, int c, int channel_count, unsigned char *chunk, int frames, int chunk_frames){
+    channel_table *ch = &dev->ch;
+    if (dev->profile) clock_gettime(CLOCK_MONOTONIC_RAW, &dev->profile->t); // Not waiting for input
+    if (dev->use_planes){
+        // One streaming pass over the interleaved buffer for all channels
+        dev->kernels.deinterleave(channel_count, chunk, chunk_frames, ch->planes + c * ch->plane_stride + frames, ch->plane_stride, &ch->plane_peak[c]);
+    }else{
+        // Peak detection
+        dev->kernels.find_peak(channel_count, chunk, chunk_frames, &ch->max_l[c], &ch->previous_max_l[c], &ch->previous_max_v[c]);//, previous_previous_max_l, previous_previous_max_v);
+    }
+    if (dev->profile) profile_mark(dev->profile, STAGE_SCAN);
+}
+
+// Meters
+// With -O, the state of every input is published once per buffer in a shared memory segment
+// for an external meter or GUI, see tap2midi_meter.h and tap2meter.c. The capture thread
+// only writes memory: no syscall, no lock, a slow reader cannot delay it.
+char *meter_name = NULL;
+meter_segment *meter = NULL;
+
+void open_meter(int channel_count){
+    size_t size = meter_segment_size(channel_count);
+    capture_device *dev;
+    int fd, i;
+
+    if ((fd = shm_open(meter_name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+        fprintf (stderr, "cannot create shared memory %s (%s)\n", meter_name, strerror(errno));
+        exit (1);
+    }
+    if (ftruncate(fd, size) < 0 || (meter = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        fprintf (stderr, "cannot map shared memory %s (%s)\n", meter_name, strerror(errno));
+        exit (1);
+    }
+    close(fd);
+    meter->version = meter_version;
+    meter->device_count = device_count;
+    meter->channel_count = channel_count;
+    for (i = 0; i < device_count; i++){
+        dev = &devices[i];
+        meter->devices[i].first_channel = dev->first_channel;
+        meter->devices[i].channels = dev->channels;
+        meter->devices[i].sample_rate = dev->source.sample_rate;
+        meter->devices[i].period_frames = buf_frames;
+    }
+    atomic_store(&meter->running, 1);
+    // Readers check the magic number last
+    atomic_store_explicit(&meter->magic, meter_magic, memory_order_release);
+    printf ("meters published in shared memory %s\n", meter_name);
+}
+
+void close_meter(void){
+    atomic_store(&meter->running, 0);
+    munmap(meter, meter_segment_size(meter->channel_count));
+    shm_unlink(meter_name);
+}
+
+// Seqlock writer, the sequence number is odd while the block of the device is rewritten
+void meter_publish(capture_device *dev){
+    meter_device *md = &meter->devices[dev - devices];
+    meter_channel *mc = &meter->channels[dev->first_channel];
+    channel_table *ch = &dev->ch;
+    float scale = 1.0 / dev->max_sample_value;
+    unsigned int seq = atomic_load_explicit(&md->seq, memory_order_relaxed);
+    int c;
+
+    atomic_store_explicit(&md->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    md->periods = dev->bufcount;
+    md->xruns = dev->xruns;
+    md->frames_lost = dev->frames_lost;
+    for (c = 0; c < dev->channels; c++, mc++){
+        mc->method = ch->engine[c]->method;
+        mc->level = (dev->use_planes ? ch->plane_peak[c] : ch->max_l[c]) * scale;
+        mc->trigger = ch->trig_level[c] * scale;
+        mc->velocity = ch->last_velocity[c];
+        mc->notes = ch->note_count[c];
+        mc->envelope = mc->method == 1 ? ch->decay[c] * scale : 0;
+        mc->state = channel_state(dev, c);
+    }
+    atomic_store_explicit(&md->seq, seq + 2, memory_order_release);
+}
+
+// Run the detectors on the buffer scanned since detector_begin, captured until buffer_end
+void detector_run(capture_device *dev, struct timespec *buffer_end){
+    int first = dev->first_channel;
+    unsigned int sample_rate = dev->source.sample_rate;
+    long long buffer_pos = dev->buffer_pos; // Frame position of current buffer in input stream, gaps included
+    channel_table *ch = &dev->ch;
+    struct timespec buffer_start, off_time;
+    timer *t;
+    int c, run_count = 0;
+
+    if (dev->profile) clock_gettime(CLOCK_MONOTONIC_RAW, &dev->profile->t);
+    frame_time(&buffer_start, buffer_end, -buf_frames, sample_rate);
+    capture_time = *buffer_end;
+    dev->bufcount++;
+    atomic_fetch_add_explicit(&buffers_total, 1, memory_order_relaxed);
+#ifdef debug
+    fprintf (stderr, ".");
+#endif
+    // Timers due in this buffer, note-offs go before any new note
+    for (t = timer_expire(&dev->wheel, buffer_pos + buf_frames); t; t = t->next){
+        c = t->channel;
+        if (t->type == TIMER_NOTE_OFF){
+#ifdef debug
+            fprintf (stderr, "\nx %u %lld ", c, t->due);
+#endif
+            frame_time(&off_time, &buffer_start, t->due - buffer_pos, sample_rate);
+            send_note_off(first + c, ch->midi_channel[c], ch->midi_note[c], &off_time);
+        }else{ // Retrigger inhibit over, look for a trigger from there on
+            ch->state[c] = STATE_IDLE;
+            ch->start_frame[c] = max(t->due - buffer_pos, 0LL);
+        }
+    }
+    if (dev->snapshots) snapshot_buffer(dev);
+    // Only channels with work in this buffer are run: those in the middle of a hit and
+    // those whose scan found something, e.g. a level above the trigger level
+    for(c = 0; c < dev->detectors; c++){
+        if (ch->engine[c]->scan(dev, c)){
+            ch->busy[c / 64] |= 1ULL << (c % 64);
+        }
+    }
+    for(c = next_channel(ch->busy, dev->detectors, 0); c >= 0; c = next_channel(ch->busy, dev->detectors, c + 1)){
+        if (!ch->engine[c]->run(dev, c, &buffer_start)){
+            ch->busy[c / 64] &= ~(1ULL << (c % 64));
+        }
+        run_count++;
+    }
+    if (dev->snapshots) snapshot_flush(dev, buffer_pos + buf_frames);
+    if (dev->profile) profile_mark(dev->profile, STAGE_DETECT);
+    send_midi_batch();
+    if (dev->profile) profile_mark(dev->profile, STAGE_MIDI);
+    if (meter) meter_publish(dev);
+    if (dev->profile){
+        profile_mark(dev->profile, STAGE_TOTAL);
+        profile_period_end(dev, run_count);
+    }
+    dev->buffer_pos += buf_frames;
+}
+
+// After the last buffer
+void detector_end(capture_device *dev){
+    struct timespec pause = {0, 1000000};
+    atomic_store(&dev->params.stopped, 1);
+    while (atomic_load(&dev->params.in_use)) nanosleep(&pause, NULL);
+    if (early_ms > 0) print_calibration(dev, dev->channels);
+    if (compare_count) print_compare(dev);
+    if (dev->profile){
+        print_profile(dev);
+        close_profile(dev);
+    }
+    if (dev->snapshots) snapshot_cut(dev);
+    channel_table_free(&dev->ch);
+    free(dev->params.current);
+    free(dev->params.next);
+}
+
+void *capture_thread(void *arg){
+    capture_device *dev = arg;
+    audio_source *src = &dev->source;
+    unsigned int sample_rate = src->sample_rate;
+    unsigned char* chunk; // Frames being scanned, in buf or in the mmap ring
+    int chunk_frames, frames;
+    int err = 0;
+    int running = 1;
+    // Overruns
+    int recovering = 0; // Capture restarted, the next buffer follows a gap
+    long long gap_frames;
+    struct timespec xrun_time, now;
+    float recovery_ms;
+    struct timespec buffer_start, buffer_end;
+
+    detector_init(dev);
+
+    ///////////////
+    // Main loop //
+    ///////////////
+    printf ("About to start reading %s\n", dev->name);
+    thread_queue = &dev->queue;
+    sem_post(&device_ready); // Let main start the next device
+    pthread_barrier_wait(&devices_start);
+    if (dev->realtime){
+        set_realtime(dev->name, rt_priority, dev->cpu);
+    }
+    while (keepRunning && running) { 
+        detector_begin(dev);
+        // Format-dependant scan, in place, one or two chunks per buffer
+        for(frames = 0; frames < buf_frames; frames += chunk_frames){
+            if ((chunk_frames = src->begin (src, &chunk, buf_frames - frames)) <= 0){
+                err = chunk_frames;
+                break;
+            }
+            detector_scan(dev, 0, dev->channels, chunk, frames, chunk_frames);
+            if ((err = src->commit (src, chunk_frames)) < 0) break;
+        }
+        // When this buffer was captured
+        src->timestamp(src, &buffer_end);
+        frame_time(&buffer_start, &buffer_end, -buf_frames, sample_rate);
+        if (frames != buf_frames && err < 0 && keepRunning && src->recover && src->recover(src, err) == 0){
+            // Overrun, drop this buffer and carry on
+            if (!recovering){
+                dev->xruns++;
+                clock_gettime(CLOCK_MONOTONIC, &xrun_time);
+                recovering = 1;
+            }
+        }else if (frames != buf_frames) {
+            if (err == 0){
+                printf ("end of input from %s after %ld buffers\n", dev->name, dev->bufcount);
+            }else{
+                log_event ("read from %s failed (%s)\n",
+                     dev->name, snd_strerror(err));
+            }
+            running = 0; // Other devices carry on
+            //~ exit (1);
+        }else{ // Audio read success
+            if (recovering){
+                recovering = 0;
+                gap_frames = max(timespec_diff_ns(&buffer_start, &capture_time) * sample_rate / 1000000000LL, 0LL);
+                detector_gap(dev, gap_frames);
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                recovery_ms = timespec_diff_ns(&now, &xrun_time) / 1e6;
+                dev->max_recovery_ms = max(recovery_ms, dev->max_recovery_ms);
+                log_event ("overrun %u: %lld frames lost, recovered in %.2f ms\n", dev->xruns, gap_frames, recovery_ms);
+            }
+            detector_run(dev, &buffer_end);
+        }
+    } // end of main read loop
+
+    detector_end(dev);
+    atomic_fetch_sub(&devices_running, 1);
+    return NULL;
+}
+
+// Runtime control
+// The main thread runs an event loop once capture has started: poll() on a UNIX socket (-U)
+// where commands come in as lines of text, and on a virtual MIDI input port, for MIDI learn.
+// Commands change the parameters of one input, or all of them, through the parameter
+// blocks of their device, e.g. with socat:
+// echo "level 3 -36" | socat - UNIX-CONNECT:/tmp/tap2midi.ctl
+#define max_clients (8)
+#define max_midi_pfds (4)
+#define control_line_length (256)
+#define control_wait_ms (1000) // For the capture thread to take the previous parameter set
+
+typedef struct {
+    int fd;
+    char line[control_line_length];
+    int length;
+} control_client;
+
+char *control_path = NULL; // -U, no control socket if NULL
+int control_fd = -1; // Listening socket
+control_client clients[max_clients];
+int client_count = 0;
+snd_rawmidi_t *handle_in = NULL; // Virtual MIDI input port
+unsigned char midi_in_status, midi_in_data[2]; // MIDI input parser
+int midi_in_count = 0;
+int learn_input = -1, learn_fd = -1; // Input waiting for a note on, and who asked
+int reply_failed = 0; // A reply could not be sent, e.g. EPIPE
+
+void open_control(void){
+    struct sockaddr_un addr;
+    int err;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(control_path) >= sizeof(addr.sun_path)){
+        fprintf (stderr, "%s: control socket path too long\n", control_path);
+        exit (1);
+    }
+    strcpy(addr.sun_path, control_path);
+    unlink(control_path); // Left over by a previous run
+    if ((control_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(control_fd, max_clients) < 0){
+        fprintf (stderr, "cannot create control socket %s (%s)\n", control_path, strerror(errno));
+        exit (1);
+    }
+    if ((err = snd_rawmidi_open(&handle_in, NULL, "virtual", SND_RAWMIDI_NONBLOCK)) < 0){
+        fprintf (stderr, "cannot open MIDI input (%s), no MIDI learn\n", snd_strerror(err));
+        handle_in = NULL;
+    }
+    printf ("control socket %s\n", control_path);
+}
+
+void close_control(void){
+    int i;
+    for (i = 0; i < client_count; i++){
+        close(clients[i].fd);
+    }
+    close(control_fd);
+    unlink(control_path);
+    if (handle_in) snd_rawmidi_close(handle_in);
+}
+
+void control_reply(int fd, const char *format, ...){
+    char text[control_line_length * 2];
+    va_list args;
+    if (fd < 0) return;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    // No SIGPIPE if the client went away, read_client closes it
+    if (send(fd, text, strlen(text), MSG_NOSIGNAL) < 0) reply_failed = 1;
+}
+
+// Device of global input number input, its channel in c
+capture_device *find_input(int input, int *c){
+    int i;
+    for (i = 0; i < device_count; i++){
+        if (input >= devices[i].first_channel && input < devices[i].first_channel + devices[i].channels){
+            *c = input - devices[i].first_channel;
+            return &devices[i];
+        }
+    }
+    return NULL;
+}
+
+// Keep the detectors and parameters of a device from being freed while the event loop
+// works on them; returns -1 if its capture thread has stopped, nothing to work on
+int control_acquire(capture_device *dev){
+    atomic_store(&dev->params.in_use, 1);
+    if (atomic_load(&dev->params.stopped)){
+        atomic_store(&dev->params.in_use, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void control_release(capture_device *dev){
+    atomic_store(&dev->params.in_use, 0);
+}
+
+// Hand the current parameters of a device over to its capture thread, device acquired
+// Returns -1 if the capture thread did not take the previous set, it has stopped
+int update_params(capture_device *dev){
+    struct timespec pause = {0, 1000000};
+    int i;
+    for (i = 0; atomic_load_explicit(&dev->params.ready, memory_order_acquire); i++){
+        if (i == control_wait_ms || atomic_load(&dev->params.stopped)) return -1;
+        nanosleep(&pause, NULL);
+    }
+    memcpy(dev->params.next, dev->params.current, dev->channels * sizeof(channel_params));
+    atomic_store_explicit(&dev->params.ready, 1, memory_order_release);
+    return 0;
+}
+
+void show_input(int fd, capture_device *dev, int c){
+    channel_params *p = &dev->params.current[c];
+    float ms_per_frame = 1000.0 / dev->source.sample_rate;
+    if (control_acquire(dev) < 0){
+        control_reply(fd, "input %d: %s has stopped\n", dev->first_channel + c, dev->name);
+        return;
+    }
+    control_reply(fd, "input %d: method %d level %.1f db peak %.2f ms wait %.2f ms channel %d note %d\n",
+        dev->first_channel + c, dev->ch.engine[c]->method,
+        20 * log10((double)p->trig_level / dev->max_sample_value),
+        p->peak_frames * ms_per_frame, p->wait_frames * ms_per_frame, p->midi_channel + 1, p->midi_note);
+    control_release(dev);
+}
+
+// One line from a client
+// set commands: level db, peak ms, wait ms, channel 1..16, note 0..127, followed by an input or all
+void control_command(int fd, char *line){
+    char command[16], target[16], bidon;
+    float value;
+    int n, input, first, last, c = 0;
+    capture_device *dev;
+    unsigned int changed = 0; // Bit per device
+    channel_params *p;
+
+    n = sscanf(line, "%15s %15s %f %c", command, target, &value, &bidon);
+    if (n <= 0) return;
+    if (!strcmp(command, "help")){
+        control_reply(fd, "show [input]\nlevel|peak|wait|channel|note input|all value\nlearn input\n");
+        return;
+    }
+    if (n == 1 && !strcmp(command, "show")){
+        first = 0;
+        last = devices[device_count - 1].first_channel + devices[device_count - 1].channels - 1;
+    }else if (n >= 2 && !strcmp(target, "all")){
+        first = 0;
+        last = devices[device_count - 1].first_channel + devices[device_count - 1].channels - 1;
+    }else if (n >= 2 && sscanf(target, "%d%c", &input, &bidon) == 1 && find_input(input, &c)){
+        first = last = input;
+    }else{
+        control_reply(fd, "error: %s\n", n >= 2 ? "no such input" : "input missing");
+        return;
+    }
+    if (!strcmp(command, "show")){
+        for (input = first; input <= last; input++){
+            dev = find_input(input, &c);
+            show_input(fd, dev, c);
+        }
+        return;
+    }
+    if (!strcmp(command, "learn")){
+        if (!handle_in || first != last){
+            control_reply(fd, "error: %s\n", handle_in ? "learn one input at a time" : "no MIDI input");
+            return;
+        }
+        learn_input = first;
+        learn_fd = fd;
+        control_reply(fd, "input %d: play a note on the tap2midi MIDI input\n", first);
+        return;
+    }
+    if (n != 3){
+        control_reply(fd, "error: unknown command or missing value, try help\n");
+        return;
+    }
+    if ((strcmp(command, "level") ? value < 0 : value >= 0 || value < trigger_level_min_db) // Levels in db below full scale, times in ms
+        || (!strcmp(command, "channel") && (value < 1 || value > 16)) || (!strcmp(command, "note") && (value < 0 || value > 127))){
+        control_reply(fd, "error: value out of range\n");
+        return;
+    }
+    for (input = first; input <= last; input++){
+        dev = find_input(input, &c);
+        if (control_acquire(dev) < 0){
+            control_reply(fd, "error: %s has stopped\n", dev->name);
+            return;
+        }
+        p = &dev->params.current[c];
+        if (!strcmp(command, "level")){
+            p->trig_level = dev->max_sample_value / exp(value * log(2)/-6.0);
+        }else if (!strcmp(command, "peak")){
+            p->peak_frames = roundf(value * dev->source.sample_rate) / 1000;
+        }else if (!strcmp(command, "wait")){
+            p->wait_frames = roundf(value * dev->source.sample_rate) / 1000;
+        }else if (!strcmp(command, "channel")){
+            p->midi_channel = value - 1;
+        }else if (!strcmp(command, "note")){
+            p->midi_note = value;
+        }else{
+            control_release(dev);
+            control_reply(fd, "error: unknown command, try help\n");
+            return;
+        }
+        control_release(dev);
+        changed |= 1 << (dev - devices);
+    }
+    for (n = 0; n < device_count; n++){
+        if (!(changed & 1 << n)) continue;
+        if (control_acquire(&devices[n]) < 0 || update_params(&devices[n]) < 0){
+            control_release(&devices[n]);
+            control_reply(fd, "error: %s has stopped\n", devices[n].name);
+            return;
+        }
+        control_release(&devices[n]);
+    }
+    for (input = first; input <= last; input++){
+        dev = find_input(input, &c);
+        show_input(fd, dev, c);
+    }
+}
+
+// MIDI input, a note on teaches its channel and note to the input being learned
+void read_midi_input(void){
+    unsigned char buf[64], b;
+    capture_device *dev;
+    int got, i, c = 0, err;
+    while ((got = snd_rawmidi_read(handle_in, buf, sizeof(buf))) > 0){
+        for (i = 0; i < got; i++){
+            b = buf[i];
+            if (b >= 0xF8) continue; // Real time, may come anywhere
+            if (b & 0x80){
+                midi_in_status = b < 0xF0 ? b : 0; // Ignore system messages
+                midi_in_count = 0;
+                continue;
+            }
+            if (!midi_in_status) continue;
+            midi_in_data[midi_in_count++] = b;
+            if ((midi_in_status & 0xE0) == 0xC0 || midi_in_count == 2){ // Program change and channel pressure have one byte
+                midi_in_count = 0;
+                if ((midi_in_status & 0xF0) == 0x90 && midi_in_data[1] && learn_input >= 0){
+                    dev = find_input(learn_input, &c);
+                    if (control_acquire(dev) < 0){
+                        control_reply(learn_fd, "error: %s has stopped\n", dev->name);
+                    }else{
+                        dev->params.current[c].midi_channel = midi_in_status & 0x0F;
+                        dev->params.current[c].midi_note = midi_in_data[0];
+                        err = update_params(dev);
+                        control_release(dev);
+                        if (err < 0){
+                            control_reply(learn_fd, "error: %s has stopped\n", dev->name);
+                        }else{
+                            show_input(learn_fd, dev, c);
+                        }
+                    }
+                    learn_input = -1;
+                }
+            }
+        }
+    }
+}
+
+// Read from client i, run its complete lines; returns -1 once it has gone
+int read_client(int i){
+    control_client *cl = &clients[i];
+    char *end;
+    int got;
+    if ((got = read(cl->fd, cl->line + cl->length, sizeof(cl->line) - 1 - cl->length)) <= 0){
+        return -1;
+    }
+    cl->length += got;
+    cl->line[cl->length] = 0;
+    reply_failed = 0;
+    while (!reply_failed && (end = strchr(cl->line, '\n'))){
+        *end = 0;
+        control_command(cl->fd, cl->line);
+        cl->length -= end + 1 - cl->line;
+        memmove(cl->line, end + 1, cl->length + 1);
+    }
+    if (cl->length == sizeof(cl->line) - 1){
+        control_reply(cl->fd, "error: line too long\n");
+        cl->length = 0;
+    }
+    return reply_failed ? -1 : 0;
+}
+
+// Main thread, until interrupted or every capture thread has finished
+void event_loop(void){
+    struct pollfd pfds[1 + max_midi_pfds + max_clients];
+    unsigned short revents;
+    int n, i, midi_first, midi_count = 0, client_first, fd;
+
+    while (keepRunning && atomic_load(&devices_running) > 0){
+        n = 0;
+        if (control_fd >= 0){
+            pfds[n].fd = control_fd;
+            pfds[n++].events = POLLIN;
+        }
+        midi_first = n;
+        if (handle_in){
+            midi_count = snd_rawmidi_poll_descriptors(handle_in, pfds + n, max_midi_pfds);
+            n += max(midi_count, 0);
+        }
+        client_first = n;
+        for (i = 0; i < client_count; i++){
+            pfds[n].fd = clients[i].fd;
+            pfds[n++].events = POLLIN;
+        }
+        if (poll(pfds, n, 100) <= 0) continue; // Timeout to check on the capture threads, or a signal
+        if (midi_count > 0 && snd_rawmidi_poll_descriptors_revents(handle_in, pfds + midi_first, midi_count, &revents) >= 0
+            && (revents & POLLIN)){
+            read_midi_input();
+        }
+        for (i = client_count - 1; i >= 0; i--){ // Last first, a closed client is replaced by the last one
+            if (pfds[client_first + i].revents && read_client(i) < 0){
+                if (clients[i].fd == learn_fd) learn_fd = -1;
+                close(clients[i].fd);
+                clients[i] = clients[--client_count];
+            }
+        }
+        if (control_fd >= 0 && (pfds[0].revents & POLLIN) && (fd = accept(control_fd, NULL, NULL)) >= 0){
+            if (client_count == max_clients){
+                control_reply(fd, "error: too many clients\n");
+                close(fd);
+            }else{
+                clients[client_count].fd = fd;
+                clients[client_count++].length = 0;
+            }
+        }
+    }
+}
+
+#ifdef jack
+// JACK process callback, the capture loop of a JACK device
+// Runs in the JACK real-time thread, which is also the producer of the device queue
+int jack_process(jack_nframes_t nframes, void *arg){
+    capture_device *dev = arg;
+    audio_source *src = &dev->source;
+    jack_nframes_t current_frames;
+    jack_time_t current_usecs, next_usecs;
+    float period_usecs;
+    struct timespec buffer_end;
+    unsigned char *in;
+    int c;
+
+    thread_queue = &dev->queue;
+    jack_midi_buffer = jack_port_get_buffer(jack_midi_port, nframes);
+    jack_midi_clear_buffer(jack_midi_buffer);
+    jack_offset = 0;
+    if (nframes != buf_frames || !keepRunning) return 0;
+    detector_begin(dev);
+    for (c = 0; c < dev->channels; c++){
+        in = jack_port_get_buffer(src->ports[c], nframes);
+        detector_scan(dev, c, 1, in, 0, nframes);
+    }
+    // The input of this cycle was captured during the period that just ended
+    // JACK times are CLOCK_MONOTONIC microseconds on Linux
+    jack_get_cycle_times(jack_client, &current_frames, &current_usecs, &next_usecs, &period_usecs);
+    buffer_end.tv_sec = current_usecs / 1000000;
+    buffer_end.tv_nsec = current_usecs % 1000000 * 1000;
+    frame_time(&jack_buffer_start, &buffer_end, -buf_frames, jack_rate);
+    if (dev->bufcount && current_frames != src->next_frame){
+        // Cycles skipped by an xrun, a time discontinuity as with ALSA overruns
+        dev->xruns++;
+        detector_gap(dev, (jack_nframes_t)(current_frames - src->next_frame));
+        log_event ("xrun %u: %u frames lost\n", dev->xruns, (jack_nframes_t)(current_frames - src->next_frame));
+    }
+    src->next_frame = current_frames + nframes;
+    detector_run(dev, &buffer_end);
+    return 0;
+}
+
+// Detectors are set up for one period size
+int jack_buffer_size(jack_nframes_t nframes, void *arg){
+    if (nframes != buf_frames){
+        fprintf (stderr, "JACK period changed to %u frames, restart tap2midi\n", nframes);
+        keepRunning = 0;
+    }
+    return 0;
+}
+
+void jack_shutdown(void *arg){
+    keepRunning = 0;
+}
+
+// Runs until interrupted or JACK goes away
+void run_jack_device(capture_device *dev){
+    detector_init(dev);
+    jack_set_process_callback(jack_client, jack_process, dev);
+    jack_set_buffer_size_callback(jack_client, jack_buffer_size, dev);
+    jack_on_shutdown(jack_client, jack_shutdown, dev);
+    if (jack_activate(jack_client)){
+        fprintf (stderr, "cannot activate JACK client\n");
+        return;
+    }
+    printf ("JACK client active, connect its ports\n");
+    event_loop();
+    jack_deactivate(jack_client);
+    detector_end(dev);
+}
+#endif
+
+// Synthetic takes
+// Drum-like hits with a known onset frame and velocity: a short attack up to the peak, then
+// a decaying tone, with a burst of noise for the stick over the first millisecond. A bounce,
+// a noise floor and crosstalk from the other inputs can be added. The peak of a hit of
+// velocity v is the level peak_velocity() turns back into v.
+#define synth_attack_ms (0.2)
+#define synth_click_ms (1)
+#define synth_tone_hz (180)
+#define synth_decay_ms (5)
+#define synth_bounce_ms (8)
+
+typedef struct {
+    int channels;
+    unsigned int sample_rate;
+    int hits; // Per input
+    float bounce; // Level of a second strike synth_bounce_ms after each hit, relative to it, 0 for none
+    float noise_db; // Noise floor, relative to full scale, 0 for none
+    float crosstalk_db; // Each input hears the hits of the others this much lower, 0 for none
+    float trigger_db; // Level of velocity 1
+    int edge_frames; // Onsets on a multiple of this, give or take a frame, 0 for anywhere
+} synth_params;
+
+typedef struct {
+    int input;
+    long long onset; // Frame where the attack starts
+    int velocity;
+} synth_hit;
+
+// Same take on every machine, whatever rand() does
+unsigned int synth_random(unsigned int *seed){
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+// Adds a hit of peak level a, onset at frame, to input c (and to the others with crosstalk)
+void synth_strike(synth_params *p, int *samples, long long frames, int c, long long onset, double a, unsigned int *seed){
+    int attack = max(roundf(synth_attack_ms * p->sample_rate / 1000), 1.0f);
+    int click = synth_click_ms * p->sample_rate / 1000;
+    int length = 12 * synth_decay_ms * p->sample_rate / 1000;
+    double crosstalk = p->crosstalk_db ? pow(10, p->crosstalk_db / 20) : 0;
+    double x, gain;
+    long long n;
+    int i, k;
+    for(i = 0; i < length && onset + i < frames; i++){
+        n = onset + i;
+        x = i < attack ? (double)i / attack : exp(-(i - attack) / (synth_decay_ms * p->sample_rate / 1000.0));
+        x *= cos(2 * M_PI * synth_tone_hz * (i - attack) / p->sample_rate);
+        if (i < click && i != attack){ // The peak stays at the end of the attack
+            x = (x + x * ((synth_random(seed) % 2001) / 1000.0 - 1.0)) / 2;
+        }
+        x *= a;
+        for(k = 0; k < p->channels; k++){
+            gain = k == c ? 1.0 : crosstalk;
+            if (gain != 0) samples[n * p->channels + k] += lround(x * gain);
+        }
+    }
+}
+
+// Renders a take of 24-bit samples, returns its length in frames
+// Hits are 150 to 400 ms apart on each input, the inputs are not in step
+long long synth_take(synth_params *p, int **samples, synth_hit **hits, int *hit_count){
+    int max_sample_value = 0x7FFFFF;
+    int trig = max_sample_value / exp(p->trigger_db * log(2)/-6.0);
+    double noise = p->noise_db ? max_sample_value * pow(10, p->noise_db / 20) : 0;
+    unsigned int seed = 1;
+    long long frames, onset, n;
+    int c, h, count = 0, a;
+    synth_hit *hit;
+
+    frames = (p->hits + 1) * 400LL * p->sample_rate / 1000;
+    *samples = calloc(frames * p->channels, sizeof(int));
+    *hits = hit = calloc(p->channels * p->hits, sizeof(synth_hit));
+    if (*samples == NULL || *hits == NULL){
+        fprintf (stderr, "cannot allocate synthetic take\n");
+        exit (1);
+    }
+    for(c = 0; c < p->channels; c++){
+        onset = (100 + 37 * c) * p->sample_rate / 1000;
+        for(h = 0; h < p->hits; h++){
+            onset += (150 + synth_random(&seed) % 250) * p->sample_rate / 1000;
+            if (p->edge_frames){
+                onset = onset / p->edge_frames * p->edge_frames + (int)(synth_random(&seed) % 3) - 1;
+            }
+            hit->input = c;
+            hit->onset = onset;
+            hit->velocity = 5 + synth_random(&seed) % 123;
+            // Rounded up, so that peak_velocity() gives the velocity back
+            a = trig + ((hit->velocity - 1) * (long long)(max_sample_value - trig) + 125) / 126;
+            synth_strike(p, *samples, frames, c, onset, a, &seed);
+            if (p->bounce) synth_strike(p, *samples, frames, c, onset + synth_bounce_ms * p->sample_rate / 1000, a * p->bounce, &seed);
+            hit++;
+            count++;
+        }
+    }
+    for(n = 0; n < frames * p->channels; n++){
+        if (noise) (*samples)[n] += lround(noise * ((synth_random(&seed) % 2001) / 1000.0 - 1.0));
+        (*samples)[n] = max(min((*samples)[n], max_sample_value), -max_sample_value);
+    }
+    *hit_count = count;
+    return frames;
+}
+
+void put_le16(unsigned char *p, unsigned int v){
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+void put_le32(unsigned char *p, unsigned int v){
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+// Writes samples of full scale max_sample_value as a WAV file in the given format
+// S24_LE is written as S32_LE: WAV 32-bit PCM is read left-justified, as it is read back here
+int write_wav(char *file_name, sample_format_info *fi, int channels, unsigned int sample_rate, int *samples, long long frames, int max_sample_value){
+    unsigned char hdr[44], *frame;
+    FILE *f;
+    long long n;
+    int c;
+    unsigned int data_bytes;
+    if (fi->format == SND_PCM_FORMAT_S24_LE) fi = get_format_info(SND_PCM_FORMAT_S32_LE);
+    data_bytes = frames * channels * fi->bytes;
+    if ((f = fopen(file_name, "wb")) == NULL){
+        fprintf (stderr, "cannot create %s (%s)\n", file_name, strerror(errno));
+        return -1;
+    }
+    memcpy(hdr, "RIFF", 4);
+    put_le32(hdr + 4, 36 + data_bytes);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    put_le32(hdr + 16, 16);
+    put_le16(hdr + 20, fi->format == SND_PCM_FORMAT_FLOAT_LE ? 3 : 1);
+    put_le16(hdr + 22, channels);
+    put_le32(hdr + 24, sample_rate);
+    put_le32(hdr + 28, sample_rate * channels * fi->bytes);
+    put_le16(hdr + 32, channels * fi->bytes);
+    put_le16(hdr + 34, fi->bytes * 8);
+    memcpy(hdr + 36, "data", 4);
+    put_le32(hdr + 40, data_bytes);
+    fwrite(hdr, 1, sizeof(hdr), f);
+    frame = malloc(channels * fi->bytes);
+    for(n = 0; n < frames; n++){
+        for(c = 0; c < channels; c++){
+            encode_sample(frame + c * fi->bytes, fi, samples[n * channels + c] / (double)max_sample_value);
+        }
+        fwrite(frame, fi->bytes, channels, f);
+    }
+    free(frame);
+    if (fclose(f)){
+        fprintf (stderr, "cannot write %s (%s)\n", file_name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Detection scores of a take
+// A note on matches the last hit of its input with an onset before the end of the buffer
+// where the note was decided, if that is less than score_window_ms ago. A second note on
+// the same hit is a double, a note without a hit is false.
+#define score_window_ms (50)
+
+typedef struct {
+    int hits, notes, matched, doubles, false_notes;
+    long long latency_sum, latency_max; // Frames from the onset to the end of the deciding buffer
+    long long onset_error_sum; // Frames from the onset to the onset found by the detector
+    double vx, vy, vxx, vxy, vyy; // Sums for the velocity fit, x truth, y detected
+    int velocity_error_max;
+} score;
+
+// Frame of a time counted from 0, inverse of frame_time()
+long long time_frame(struct timespec *t, unsigned int sample_rate){
+    return ((t->tv_sec * 1000000000LL + t->tv_nsec) * sample_rate + 500000000LL) / 1000000000LL;
+}
+
+void score_note(score *s, synth_hit *hits, int hit_count, int *matched, out_event *e, unsigned int sample_rate){
+    long long decided = time_frame(&e->decided, sample_rate), onset = time_frame(&e->time, sample_rate);
+    int h, found = -1, v = e->data[2];
+    s->notes++;
+    for(h = 0; h < hit_count; h++){ // Hits are in order per input
+        if (hits[h].input == e->input && hits[h].onset < decided) found = h;
+    }
+    if (found < 0 || decided - hits[found].onset > score_window_ms * (long long)sample_rate / 1000){
+        s->false_notes++;
+        return;
+    }
+    if (matched[found]){
+        s->doubles++;
+        return;
+    }
+    matched[found] = 1;
+    s->matched++;
+    s->latency_sum += decided - hits[found].onset;
+    s->latency_max = max(s->latency_max, decided - hits[found].onset);
+    s->onset_error_sum += onset - hits[found].onset;
+    s->vx += hits[found].velocity;
+    s->vy += v;
+    s->vxx += hits[found].velocity * hits[found].velocity;
+    s->vxy += hits[found].velocity * v;
+    s->vyy += v * v;
+    s->velocity_error_max = max(s->velocity_error_max, abs(v - hits[found].velocity));
+}
+
+// Runs the detectors of a device over a take, as a capture thread would, and scores the notes
+void score_take(capture_device *dev, unsigned char *data, long long frames, synth_hit *hits, int hit_count, score *s){
+    struct timespec buffer_end = {0, 0};
+    int *matched = calloc(hit_count, sizeof(int));
+    unsigned int tail;
+    long long pos;
+    out_event *e;
+
+    memset(s, 0, sizeof(*s));
+    s->hits = hit_count;
+    thread_queue = &dev->queue;
+    detector_init(dev);
+    for(pos = 0; pos + buf_frames <= frames; pos += buf_frames){
+        detector_begin(dev);
+        detector_scan(dev, 0, dev->channels, data + pos * dev->source.frame_bytes, 0, buf_frames);
+        frame_time(&buffer_end, &(struct timespec){0, 0}, pos + buf_frames, dev->source.sample_rate);
+        detector_run(dev, &buffer_end);
+        // Consume the output queue
+        for(tail = dev->queue.tail; tail != dev->queue.head; tail++){
+            e = &dev->queue.events[tail & (event_queue_size - 1)];
+            if (e->type == EVENT_MIDI && (e->data[0] & 0xF0) == 0x90 && e->data[2]){
+                score_note(s, hits, hit_count, matched, e, dev->source.sample_rate);
+            }
+        }
+        dev->queue.tail = tail;
+    }
+    detector_end(dev);
+    free(matched);
+}
+
+// Snapshot clips are written in the device format, replaying one with -i has to give the
+// level that was captured, or tuning -l on clips is off. Writes a decaying hit in every
+// format as snapshot_write does and reads it back as -i does. Returns the failures.
+#define clip_level_db (-6.0)
+#define clip_tolerance_db (0.1)
+
+int check_clip_levels(void){
+    char name[64];
+    sample_format_info *fi;
+    audio_source src;
+    format_kernels kernels;
+    unsigned char *data;
+    int samples[1024], max_sample_value, peak, previous_peak, previous_velocity, i, failures = 0;
+    double level_db;
+
+    snprintf(name, sizeof(name), "/tmp/tap2midi_clip_%d.wav", (int)getpid());
+    for(fi = sample_formats; fi->kernels; fi++){
+        for(i = 0; i < 1024; i++){
+            samples[i] = fi->max_sample_value * pow(10, clip_level_db / 20) * exp(-i / 200.0) * ((i & 1) ? -1 : 1);
+        }
+        memset(&src, 0, sizeof(src));
+        peak = previous_peak = previous_velocity = 0;
+        level_db = -INFINITY;
+        if (!write_wav(name, fi, 1, 44100, samples, 1024, fi->max_sample_value)
+            && (src.file = fopen(name, "rb")) && !read_wav_header(&src)){
+            src.frame_bytes = select_format(src.format, 1, &max_sample_value, &kernels);
+            src.buf = malloc(1024 * src.frame_bytes);
+            if (src.frame_bytes > 0 && file_begin(&src, &data, 1024) == 1024){
+                kernels.find_peak(1, data, 1024, &peak, &previous_peak, &previous_velocity);
+                level_db = 20 * log10((double)peak / max_sample_value);
+            }
+            free(src.buf);
+        }
+        if (src.file) fclose(src.file);
+        unlink(name);
+        if (fabs(level_db - clip_level_db) > clip_tolerance_db) failures++;
+        printf("clip %-8s written at %.1f db replays at %.1f db  %s\n", snd_pcm_format_name(fi->format), clip_level_db, level_db,
+            fabs(level_db - clip_level_db) > clip_tolerance_db ? "FAIL" : "ok");
+    }
+    return failures;
+}
+
+// Detector regression suite, -T
+// Each case renders a synthetic take and runs one method over it with fixed parameters,
+// whatever the command line says. In the exact cases every hit must give exactly one note:
+// a change to the detectors that drops or doubles hits fails the suite. The other cases
+// fail below their minimum recall and precision or above their doubled and false notes.
+typedef struct {
+    const char *name;
+    int method;
+    int frames; // Buffer size
+    float trig_ms, wait_ms, level_db;
+    synth_params synth; // Channels, rate and trigger level are filled in
+    int exact;
+    struct {
+        float recall, precision;
+        int doubles, false_notes;
+    } limits; // Of the other cases, from the results of the current detectors
+} test_case;
+
+#define test_channels (4)
+#define test_hits (40)
+
+const test_case test_cases[] = {
+    {"clean", 2, 128, 2, 25, -30, {.hits = test_hits}, 1},
+    {"clean", 3, 128, 2, 25, -30, {.hits = test_hits}, 1},
+    {"clean", 1, 128, 8, 0, -30, {.hits = test_hits}, 0, {0.83, 1.0, 0, 0}},
+    {"edges", 2, 64, 2, 25, -30, {.hits = test_hits, .edge_frames = 64}, 1},
+    {"edges", 2, 100, 2, 25, -30, {.hits = test_hits, .edge_frames = 100}, 1},
+    {"edges", 2, 16, 2, 25, -30, {.hits = test_hits, .edge_frames = 16}, 1},
+    {"edges", 3, 100, 2, 25, -30, {.hits = test_hits, .edge_frames = 100}, 1},
+    {"edges", 1, 64, 8, 0, -30, {.hits = test_hits, .edge_frames = 64}, 0, {0.86, 1.0, 0, 0}},
+    {"long", 2, 32, 20, 120, -30, {.hits = test_hits}, 1}, // Peak window and inhibit over many buffers
+    {"bounce", 2, 128, 2, 25, -30, {.hits = test_hits, .bounce = 0.6}, 1},
+    {"bounce", 3, 128, 2, 25, -30, {.hits = test_hits, .bounce = 0.6}, 1},
+    {"bounce", 1, 128, 8, 0, -30, {.hits = test_hits, .bounce = 0.6}, 0, {0.80, 1.0, 0, 0}},
+    {"noise", 2, 128, 2, 25, -30, {.hits = test_hits, .noise_db = -50}, 1},
+    {"noise", 3, 128, 2, 25, -30, {.hits = test_hits, .noise_db = -50}, 1},
+    {"noise", 1, 128, 8, 0, -30, {.hits = test_hits, .noise_db = -50}, 0, {0.825, 1.0, 0, 0}},
+    {"crosstalk", 2, 128, 2, 25, -30, {.hits = test_hits, .crosstalk_db = -24}, 0, {0.95, 0.43, 23, 175}},
+    {"crosstalk", 3, 128, 2, 25, -30, {.hits = test_hits, .crosstalk_db = -24}, 0, {0.89, 0.46, 22, 141}},
+    {"crosstalk", 1, 128, 8, 0, -30, {.hits = test_hits, .crosstalk_db = -24}, 0, {0.83, 0.97, 0, 3}},
+    {NULL}
+};
+
+int run_tests(void){
+    static capture_device dev;
+    const test_case *t;
+    synth_params p;
+    synth_hit *hits;
+    sample_format_info *fi = get_format_info(SND_PCM_FORMAT_S24_3LE);
+    int *samples, hit_count, failures = 0, pass;
+    unsigned char *data;
+    long long frames, n;
+    double slope, offset, r;
+    score s;
+
+    printf("case      method buffer  hits notes recall precision doubles false  latency avg/max  onset  velocity slope offset     r max error\n");
+    for(t = test_cases; t->name; t++){
+        p = t->synth;
+        p.channels = test_channels;
+        p.sample_rate = 44100;
+        p.trigger_db = t->level_db;
+        frames = synth_take(&p, &samples, &hits, &hit_count);
+        data = malloc(frames * p.channels * fi->bytes);
+        for(n = 0; n < frames * p.channels; n++){
+            encode_sample(data + n * fi->bytes, fi, samples[n] / (double)0x7FFFFF);
+        }
+        // Detection parameters of the case
+        buf_frames = t->frames;
+        trig_delay_ms = t->trig_ms;
+        wait_delay_ms = t->wait_ms;
+        trigger_level_db = t->level_db;
+        detect_methods[0] = t->method;
+        detect_method_count = 1;
+        decay_rate_default = 0.98;
+        decay_factor_db = 6.0;
+        single_buffer = force_note_off = 0;
+        early_ms = 0;
+        compare_count = 0;
+        flux_ratio = 4;
+        memset(&dev, 0, sizeof(dev));
+        dev.name = "test";
+        dev.is_file = 1;
+        dev.quiet = 1;
+        dev.channels = dev.source.channels = p.channels;
+        dev.source.sample_rate = p.sample_rate;
+        dev.source.frame_bytes = p.channels * fi->bytes;
+        select_format(fi->format, p.channels, &dev.max_sample_value, &dev.kernels);
+        score_take(&dev, data, frames, hits, hit_count, &s);
+
+        if (t->exact){
+            pass = s.matched == s.hits && s.notes == s.matched;
+        }else{
+            pass = (float)s.matched / s.hits >= t->limits.recall - 1e-6
+                && (s.notes ? (float)s.matched / s.notes : 1.0) >= t->limits.precision - 1e-6
+                && s.doubles <= t->limits.doubles && s.false_notes <= t->limits.false_notes;
+        }
+        if (!pass) failures++;
+        slope = offset = r = 0;
+        if (s.matched > 1){
+            slope = (s.matched * s.vxy - s.vx * s.vy) / (s.matched * s.vxx - s.vx * s.vx);
+            offset = (s.vy - slope * s.vx) / s.matched;
+            r = (s.matched * s.vxy - s.vx * s.vy) / sqrt((s.matched * s.vxx - s.vx * s.vx) * (s.matched * s.vyy - s.vy * s.vy));
+        }
+        printf("%-10s %5d %6d %5d %5d %6.3f %9.3f %7d %5d %8.1f %6lld %6.1f %15.3f %6.1f %5.3f %9d  %s\n",
+            t->name, t->method, t->frames, s.hits, s.notes,
+            (float)s.matched / s.hits, s.notes ? (float)s.matched / s.notes : 0.0,
+            s.doubles, s.false_notes,
+            s.matched ? (float)s.latency_sum / s.matched : 0.0, s.latency_max,
+            s.matched ? (float)s.onset_error_sum / s.matched : 0.0,
+            slope, offset, r, s.velocity_error_max,
+            pass ? "ok" : "FAIL");
+        free(data);
+        free(samples);
+        free(hits);
+    }
+    failures += check_clip_levels();
+    printf("%d failed\n", failures);
+    return failures;
+}
+
+// Worst-case stress harness, -W
+// Adversarial input for the method 1 and 2 state machines, at 1 to 128 channels and
+// extreme -t, -w and -x values: every buffer is timed as with -u, and the output queue is
+// drained after each one to measure the MIDI burst. The deadline is the buffer duration,
+// a case whose slowest buffer misses it fails, as does one that drops MIDI messages because
+// the output queue is full. -b, -r and -s apply.
+#define stress_periods (2000) // Timed buffers per case
+#define stress_warmup (16) // Untimed buffers first, caches and page faults
+#define stress_cycle (3) // Patterns repeat every 3 buffers
+
+typedef enum {
+    PATTERN_SQUARE, // Full scale square wave, always above the trigger level
+    PATTERN_BURSTS, // Burst on every channel in every buffer, falling over 3 buffers
+    PATTERN_SPIKES, // Single full scale samples on the first and last frame of every buffer
+    PATTERN_COUNT
+} Pattern;
+const char * pattern_names[] = {"square", "bursts", "spikes"};
+
+#define stress_edge (-1) // One frame short of a buffer
+
+typedef struct {
+    const char *name;
+    float trig, wait, note_off; // -t, -w and -x in frames, stress_edge, or minus milliseconds below that
+    int floods; // Up to a note per frame and channel, may overflow the event queue by design
+} stress_timing;
+
+const stress_timing stress_timings[] = {
+    {"zero", 0, 0, 0, 1}, // Retrigger on the next frame, most re-entries of the chunk loop
+    {"frame", 1, 1, 1, 1},
+    {"edge", stress_edge, stress_edge, stress_edge, 0}, // Windows end on the last frame of a buffer
+    {"long", -2000, -5000, -60000, 0}, // Many turns of the timer wheel
+    {NULL}
+};
+
+// Delay of a stress_timing in ms, as given on the command line
+float stress_ms(float delay, unsigned int sample_rate){
+    if (delay < stress_edge) return -delay;
+    return (delay == stress_edge ? buf_frames - 1 : delay) * 1000.0 / sample_rate;
+}
+
+void fill_stress_buffers(unsigned char *buf, sample_format_info *fi, int channel_count, Pattern pattern){
+    static const double burst_levels[stress_cycle] = {1.0, 0.5, 0.25};
+    int frame, c, onset;
+    double x;
+    for(frame = 0; frame < stress_cycle * buf_frames; frame++){
+        for(c = 0; c < channel_count; c++){
+            x = 0;
+            if (pattern == PATTERN_SQUARE){
+                x = (frame + c) % buf_frames < buf_frames / 2 ? 1.0 : -1.0;
+            }else if (pattern == PATTERN_BURSTS){
+                onset = c * 7 % buf_frames; // Trigger frame differs between channels
+                if (frame % buf_frames >= onset){
+                    x = burst_levels[frame / buf_frames] * ((frame & 1) ? -1 : 1);
+                }
+            }else if (frame % buf_frames == 0 || frame % buf_frames == buf_frames - 1){
+                x = (frame & 1) ? -1.0 : 1.0;
+            }
+            encode_sample(buf, fi, x);
+            buf += fi->bytes;
+        }
+    }
+}
+
+int run_stress(snd_pcm_format_t format, unsigned int sample_rate, int cpu){
+    static const int channel_counts[] = {1, 2, 4, 8, 16, 32, 64, 128};
+    static const int methods[] = {1, 2};
+    static capture_device dev;
+    sample_format_info *fi = get_format_info(format == SND_PCM_FORMAT_UNKNOWN ? SND_PCM_FORMAT_S24_3LE : format);
+    const stress_timing *t;
+    struct timespec buffer_end = {0, 0};
+    unsigned char *data;
+    profile_stats *p;
+    Pattern pattern;
+    long i;
+    unsigned int burst, max_burst, dropped, lost, midi_lost, tail;
+    double events;
+    int mi, ci, channel_count, failures = 0, late;
+
+    printf("%d buffers of %d frames at %u Hz per case, %% of the buffer duration\n", stress_periods, buf_frames, sample_rate);
+    printf("method  ch pattern timing    avg   p99.9     max ns/ch/frame events/buffer avg/max  dropped\n");
+    // Scheduled like a capture thread, -P and the first CPU of -a
+    set_realtime("stress", rt_priority, cpu);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)){
+        fprintf (stderr, "cannot lock memory (%s)\n", strerror(errno));
+    }
+    data = malloc(stress_cycle * buf_frames * 128 * fi->bytes);
+    profiling = 1;
+    for(mi = 0; mi < sizeof(methods) / sizeof(methods[0]); mi++){
+        for(ci = 0; ci < sizeof(channel_counts) / sizeof(channel_counts[0]); ci++){
+            channel_count = channel_counts[ci];
+            for(pattern = 0; pattern < PATTERN_COUNT; pattern++){
+                fill_stress_buffers(data, fi, channel_count, pattern);
+                for(t = stress_timings; t->name; t++){
+                    trig_delay_ms = stress_ms(t->trig, sample_rate);
+                    wait_delay_ms = stress_ms(t->wait, sample_rate);
+                    max_note_off_delay_ms = stress_ms(t->note_off, sample_rate);
+                    trigger_level_db = -30;
+                    detect_methods[0] = methods[mi];
+                    detect_method_count = 1;
+                    decay_rate_default = 0.98;
+                    decay_factor_db = 6.0;
+                    single_buffer = force_note_off = 0;
+                    early_ms = 0;
+                    compare_count = 0;
+                    memset(&dev, 0, sizeof(dev));
+                    dev.name = "stress";
+                    dev.is_file = 1;
+                    dev.quiet = 1;
+                    dev.channels = dev.source.channels = channel_count;
+                    dev.source.sample_rate = sample_rate;
+                    dev.source.frame_bytes = channel_count * fi->bytes;
+                    select_format(fi->format, channel_count, &dev.max_sample_value, &dev.kernels);
+                    thread_queue = &dev.queue;
+                    detector_init(&dev);
+
+                    max_burst = dropped = midi_lost = 0;
+                    events = 0;
+                    for(i = -stress_warmup; i < stress_periods; i++){
+                        if (i == 0){ // Statistics from here on
+                            close_profile(&dev);
+                            open_profile(&dev);
+                            events = max_burst = dropped = midi_lost = 0;
+                            dev.queue.dropped = 0;
+                        }
+                        detector_begin(&dev);
+                        detector_scan(&dev, 0, channel_count,
+                            data + (i + stress_warmup) % stress_cycle * buf_frames * dev.source.frame_bytes, 0, buf_frames);
+                        frame_time(&buffer_end, &(struct timespec){0, 0}, dev.buffer_pos + buf_frames, sample_rate);
+                        detector_run(&dev, &buffer_end);
+                        // The MIDI burst of this buffer, those queued and those the full queue dropped
+                        lost = dev.queue.dropped - dropped;
+                        dropped = dev.queue.dropped;
+                        for(burst = 0, tail = dev.queue.tail; tail != dev.queue.head; tail++){
+                            burst += dev.queue.events[tail & (event_queue_size - 1)].type == EVENT_MIDI;
+                        }
+                        // A buffer with MIDI ends with a flush, unless the full queue dropped it
+                        if (lost && burst && !midi_immediate && dev.queue.events[(tail - 1) & (event_queue_size - 1)].type != EVENT_FLUSH){
+                            lost--;
+                        }
+                        burst += lost;
+                        midi_lost += lost;
+                        dev.queue.tail = tail;
+                        max_burst = max(max_burst, burst);
+                        events += burst;
+                    }
+                    p = dev.profile;
+                    late = p->max_ns[STAGE_TOTAL] > p->buffer_ns;
+                    // A dropped note off is a stuck note, unless the timing floods the queue anyway
+                    failures += late || (midi_lost && !t->floods);
+                    printf("%6d %3d %-7s %-6s %6.2f %7.1f %7.2f %11.2f %14.1f %7u %8u  %s\n",
+                        methods[mi], channel_count, pattern_names[pattern], t->name,
+                        p->sum_ns[STAGE_TOTAL] / p->periods * 100 / p->buffer_ns,
+                        profile_percentile(p, STAGE_TOTAL, 0.999) * 100,
+                        p->max_ns[STAGE_TOTAL] * 100 / p->buffer_ns,
+                        p->sum_ns[STAGE_TOTAL] / p->periods / ((double)channel_count * buf_frames),
+                        events / p->periods, max_burst, midi_lost,
+                        late ? "LATE" : !midi_lost ? "ok" : t->floods ? "overflow" : "DROPPED");
+                    close_profile(&dev);
+                    detector_end(&dev);
+                }
+            }
+        }
+    }
+    free(data);
+    printf("%d failed\n", failures);
+    return failures;
+}
+
+// Comma separated integers, returns how many or -1
+int parse_int_list(char *list, int *values, int max_count){
+    int count = 0, length;
+    while (count < max_count && sscanf(list, "%d%n", &values[count], &length) == 1){
+        count++;
+        list += length;
+        if (*list == 0) return count;
+        if (*list++ != ',') return -1;
+    }
+    return -1;
+}
+
+int parse_float_list(char *list, float *values, int max_count){
+    int count = 0, length;
+    while (count < max_count && sscanf(list, "%f%n", &values[count], &length) == 1){
+        count++;
+        list += length;
+        if (*list == 0) return count;
+        if (*list++ != ',') return -1;
+    }
+    return -1;
+}
+
+void usage(char *prog_name){
+    printf("Usage: %s [OPTION]...\n\n", prog_name);
+    printf("-A          send the velocity of early notes measured over the whole -t window as poly aftertouch\n");
+    printf("-a cpu,...  pin capture thread of each device to cpu\n");
+    printf("-B          benchmark detection kernels and exit\n");
+    printf("-b frames   buffer (period) size, 16..8192, 2048 at most with method 3, default 128\n");
+    printf("-C channel  send all inputs on this MIDI channel (1..16), one note each\n");
+    printf("-c chans,.. channel count of each device\n");
+    printf("-d rate     envelope decay rate (per 128 frames)\n");
+    printf("            typically 0.97..0.99, higher values mean more anti-bouncing\n");
+    printf("-D device   alsa sound input device, repeat for more devices\n");
+    printf("-e time     early note on time after trigger (ms), velocity predicted from the peak so far\n");
+    printf("-E gain,... predicted peak over early peak of each input, default 1, printed at exit with -e\n");
+    printf("-f          faster slope detection (may cause double-triggering)\n");
+    printf("-g factor   initial gain of envelope (db)\n");
+    printf("            typically 0, higher values mean more anti-bouncing\n");
+    printf("-F          replay input file as fast as possible\n");
+    printf("-G file     write a synthetic take of -c channels at -r Hz with 30 hits per input, print the hits\n");
+    printf("-h          display this help message\n");
+    printf("-I          send each MIDI message immediately instead of once per buffer\n");
+    printf("-K ratio    method 3 onset when the spectral flux exceeds ratio times its average, default 4\n");
+    printf("-i file     read audio from WAV or raw file instead of sound input, may be repeated\n");
+#ifdef jack
+    printf("-j name     JACK client with one audio input port per channel (-c) and a MIDI output port\n");
+#endif
+    printf("-k m,...    compare detection methods on every input, the first one sends MIDI\n");
+    printf("-L pre,post snapshot window before and after the onset (ms), default 20,80\n");
+    printf("-l level    trigger level (db, -90..0, must be negative)\n");
+    printf("            typically -36..-24, more negative values mean more sensitivity\n");
+    printf("-M m,...    detection method of each input, 1 envelope, 2 amplitude (default) or 3 spectral flux\n");
+    printf("-m          mmap capture, scan the sound input buffer in place\n");
+    printf("-n note     MIDI note of the first input, default 60\n");
+    printf("-O name     publish input levels and detector states in shared memory /name, see tap2meter\n");
+    printf("-p count    period count of sound input buffer, default 4\n");
+    printf("-P prio     SCHED_FIFO priority of audio thread, 0 for normal scheduling, default 70\n");
+    printf("-R dir      record the audio around each hit in dir, a WAV file and its detector parameters\n");
+    printf("-r rate     sample rate (Hz)\n");
+    printf("-S delay    ALSA sequencer output, notes scheduled delay ms after onset (no jitter)\n");
+    printf("-s format   sample format (S16_LE, S24_3LE, S24_LE, S32_LE, FLOAT_LE)\n");
+    printf("-T          run the detectors on synthetic takes, check that no hit is dropped or doubled\n");
+    printf("-t time     trigger delay time (ms)\n");
+    printf("-w time     retrigger wait delay time for anti-bouncing (ms)\n");
+    printf("-W          stress methods 1 and 2 with adversarial input, report the worst buffer and MIDI burst\n");
+    printf("-U path     control socket, to change input parameters while running, and MIDI learn\n");
+    printf("-u          profile the DSP load of every buffer per stage, print it with the worst buffers at exit\n");
+    printf("-v          verbose\n");
+    printf("-x time     note off (extinction) delay time (ms)\n");
+    printf("-X          force note off (extinction) before new note\n");
+    printf("-Y b,n,x    synthetic take bounce level (0..1), noise floor (db) and crosstalk (db), 0 for none\n");
+}
+
+int main (int argc, char *argv[])
+{
+    int i;
+    int err;
+    int errcount=0;
+    int paced = 1; // Replay files at real-time speed
+    int use_mmap = 0;
+    int audio_cpus[max_devices], audio_cpu_count = 0; // No pinning
+    int channel_counts[max_devices] = {2}, channel_count_count = 1;
+    pthread_t output_thread_id;
+    pthread_t snapshot_thread_id;
+    unsigned int periods = 4; // Capture latency is one period, more periods only add xrun headroom
+    snd_pcm_format_t sample_format = SND_PCM_FORMAT_UNKNOWN; // Let ALSA or the file choose
+    unsigned int sample_rate = 44100; // Will be updated by ALSA
+    int channel_bytes, total_channels = 0;
+    int alsa_count = 0; // Sound inputs opened, the first one sets the buffer size
+    int last_midi_channel, last_note;
+    char *jack_name = NULL; // JACK client instead of sound inputs
+    capture_device *dev;
+    char bidon;
+    int benchmark = 0;
+    int run_test_suite = 0;
+    int run_stress_harness = 0;
+    char *synth_file = NULL; // Synthetic take to generate
+    float synth_options[3] = {0, 0, 0}; // Bounce, noise floor, crosstalk
+
+    // Handle command-line arguments
+    int arg = 1;
+    //~ if (argc>1){
+        //~ device_name = argv[1];
+        //~ arg++;
+    //~ }
+    while(arg<argc){
+        // printf("%s\n", argv[arg]);
+        if (argv[arg][0]!='-'){
+            fprintf(stderr, "%s: not an option.\n", argv[arg]);
+            errcount++;
+        }else{ // Found dash, we know [1] is not past end of string
+            if ( argv[arg][1] && (argv[arg][2] == 0)){ // Length is ok
+                switch(argv[arg][1]){
+                    case 'h':
+                        usage(argv[0]);
+                        exit(0);
+                    case 'v':
+                        verbose++;
+                        break;
+                    case 'a': // capture threads CPU affinity, one per device
+                        if ((++arg)<argc){
+                            if ((audio_cpu_count = parse_int_list(argv[arg], audio_cpus, max_devices)) <= 0) {
+                                fprintf(stderr, "%s: not a list of integers.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'P': // real-time priority
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%d%c", &rt_priority, &bidon) != 1) {
+                                fprintf(stderr, "%s: not an integer.\n", argv[arg]);
+                                errcount++;
+                            }else if (rt_priority < 0 || rt_priority > 99){
+                                fprintf(stderr, "%s: priority must be 0..99.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'B': // Benchmark
+                        benchmark = 1;
+                        break;
+                    case 'T': // Detector regression suite
+                        run_test_suite = 1;
+                        break;
+                    case 'W': // Worst-case stress harness
+                        run_stress_harness = 1;
+                        break;
+                    case 'G': // Generate synthetic take
+                        if ((++arg)<argc){
+                            synth_file = argv[arg];
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'Y': // Synthetic take bounce, noise, crosstalk
+                        if ((++arg)<argc){
+                            if (parse_float_list(argv[arg], synth_options, 3) <= 0) {
+                                fprintf(stderr, "%s: not a list of floats.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'r': // Sample rate
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%u%c", &sample_rate, &bidon) != 1) {
+                                fprintf(stderr, "%s: not an integer.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'S': // sequencer output with scheduling delay
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%f%c", &seq_latency_ms, &bidon) != 1) {
+                                fprintf(stderr, "%s: not a float.\n", argv[arg]);
+                                errcount++;
+                            }else if (seq_latency_ms < 0){
+                                fprintf(stderr, "%s: delay must not be negative.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 's': // sample format
+                        if ((++arg)<argc){
+                            sample_format = snd_pcm_format_value(argv[arg]);
+                            if (sample_format == SND_PCM_FORMAT_UNKNOWN){
+                                fprintf(stderr, "%s: not a sample format.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'b': // buffer (period) size
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%d%c", &buf_frames, &bidon) != 1) {
+                                fprintf(stderr, "%s: not an integer.\n", argv[arg]);
+                                errcount++;
+                            }else if (buf_frames < 16 || buf_frames > 8192){
+                                fprintf(stderr, "%s: buffer size must be 16..8192 frames.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'p': // period count
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%u%c", &periods, &bidon) != 1) {
+                                fprintf(stderr, "%s: not an integer.\n", argv[arg]);
+                                errcount++;
+                            }else if (periods < 2){
+                                fprintf(stderr, "%s: at least 2 periods are needed.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'c': // channel count, one per device
+                        if ((++arg)<argc){
+                            if ((channel_count_count = parse_int_list(argv[arg], channel_counts, max_devices)) <= 0) {
+                                fprintf(stderr, "%s: not a list of integers.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'd': // decay value
+                        // see https://tomroelandts.com/articles/low-pass-single-pole-iir-filter
+                        // Per 128 frames, rescaled to the actual buffer size
+                        // FIXME parameter should be independant of sample rate
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%f%c", &decay_rate_default, &bidon) != 1) {
+                                fprintf(stderr, "%s: not a float.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'D': // device name, may be repeated
+                    case 'i': // input file, may be repeated
+                        if ((++arg)<argc){
+                            if (device_count == max_devices){
+                                fprintf(stderr, "%s: at most %d devices.\n", argv[arg], max_devices);
+                                errcount++;
+                            }else{
+                                devices[device_count].name = argv[arg];
+                                devices[device_count++].is_file = (argv[arg-1][1] == 'i');
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+#ifdef jack
+                    case 'j': // JACK client
+                        if ((++arg)<argc){
+                            jack_name = argv[arg];
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
                         break;
-                    case 'r': // Sample rate
+#endif
+                    case 'U': // Control socket
                         if ((++arg)<argc){
-                            if (sscanf(argv[arg], "%d%c", &sample_rate, &bidon) != 1) {
-                                fprintf(stderr, "%s: not an integer.\n", argv[arg]);
-                                errcount++;
-                            }
+                            control_path = argv[arg];
                         }else{
                             fprintf(stderr, "%s: missing value.\n", argv[--arg]);
                             errcount++;
                         }
                         break;
-                    case 'c': // channel count
+                    case 'u': // Profile DSP load per buffer
+                        profiling = 1;
+                        break;
+                    case 'R': // Record snapshots of the hits
                         if ((++arg)<argc){
-                            if (sscanf(argv[arg], "%d%c", &channels, &bidon) != 1) {
-                                fprintf(stderr, "%s: not an integer.\n", argv[arg]);
-                                errcount++;
-                            }
+                            snapshot_dir = argv[arg];
                         }else{
                             fprintf(stderr, "%s: missing value.\n", argv[--arg]);
                             errcount++;
                         }
                         break;
-                    case 'd': // decay value
-                        // see https://tomroelandts.com/articles/low-pass-single-pole-iir-filter
-                        // FIXME This is per frame, parameter should be independant of frame size
+                    case 'L': // Snapshot window before and after the onset
                         if ((++arg)<argc){
-                            if (sscanf(argv[arg], "%f%c", &decay_rate_default, &bidon) != 1) {
-                                fprintf(stderr, "%s: not a float.\n", argv[arg]);
+                            if (parse_float_list(argv[arg], snapshot_window_ms, 2) != 2) {
+                                fprintf(stderr, "%s: not 2 floats.\n", argv[arg]);
+                                errcount++;
+                            }else if (snapshot_window_ms[0] < 0 || snapshot_window_ms[1] < 0){
+                                fprintf(stderr, "%s: times must not be negative.\n", argv[arg]);
                                 errcount++;
                             }
                         }else{
@@ -344,17 +4606,23 @@ int main (int argc, char *argv[])
                             errcount++;
                         }
                         break;
-                    case 'D': // device name
+                    case 'O': // Meters in shared memory
                         if ((++arg)<argc){
-                            device_name = argv[arg];
+                            meter_name = argv[arg];
                         }else{
                             fprintf(stderr, "%s: missing value.\n", argv[--arg]);
                             errcount++;
                         }
                         break;
+                    case 'F': // Replay input file without real-time pacing
+                        paced = 0;
+                        break;
                     case 'f': // Fast slope detection
                         single_buffer = 1 ;
                         break;
+                    case 'I': // Immediate MIDI output, no batching per period
+                        midi_immediate = 1;
+                        break;
                     case 'g': // guard factor (envelope overshoot)
                         if ((++arg)<argc){
                             if (sscanf(argv[arg], "%f%c", &decay_factor_db, &bidon) != 1) {
@@ -366,28 +4634,133 @@ int main (int argc, char *argv[])
                             errcount++;
                         }
                         break;
+                    case 'm': // mmap capture
+                        use_mmap = 1;
+                        break;
                     case 'l': // trigger level, -db
                         if ((++arg)<argc){
                             if (sscanf(argv[arg], "%f%c", &trigger_level_db, &bidon) != 1) {
                                 fprintf(stderr, "%s: not a float.\n", argv[arg]);
                                 errcount++;
+                            }else if (trigger_level_db >= 0 || trigger_level_db < trigger_level_min_db){
+                                fprintf(stderr, "%s: level must be negative, down to %.0f db.\n", argv[arg], trigger_level_min_db);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'n': // midi note of the first input
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%d%c", &base_note, &bidon) != 1) {
+                                fprintf(stderr, "%s: not an integer.\n", argv[arg]);
+                                errcount++;
+                            }else if (base_note < 0 || base_note > 127){
+                                fprintf(stderr, "%s: note must be 0..127.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'M': // detection method of each input
+                        if ((++arg)<argc){
+                            if ((detect_method_count = parse_int_list(argv[arg], detect_methods, max_method_list)) <= 0) {
+                                fprintf(stderr, "%s: not a list of integers.\n", argv[arg]);
+                                errcount++;
+                            }else{
+                                for (i = 0; i < detect_method_count; i++){
+                                    if (get_engine(detect_methods[i]) == NULL){
+                                        fprintf(stderr, "%s: methods are 1, 2 or 3.\n", argv[arg]);
+                                        errcount++;
+                                        break;
+                                    }
+                                }
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'k': // compare detection methods
+                        if ((++arg)<argc){
+                            if ((compare_count = parse_int_list(argv[arg], compare_methods, max_compare)) < 2) {
+                                fprintf(stderr, "%s: not a list of 2 to %d methods.\n", argv[arg], max_compare);
+                                errcount++;
+                            }else{
+                                for (i = 0; i < compare_count; i++){
+                                    if (get_engine(compare_methods[i]) == NULL){
+                                        fprintf(stderr, "%s: methods are 1, 2 or 3.\n", argv[arg]);
+                                        errcount++;
+                                        break;
+                                    }
+                                }
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'e': // early note on, ms after trigger
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%f%c", &early_ms, &bidon) != 1) {
+                                fprintf(stderr, "%s: not a float.\n", argv[arg]);
+                                errcount++;
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'E': // early peak gain of each input
+                        if ((++arg)<argc){
+                            if ((early_gain_count = parse_float_list(argv[arg], early_gains, max_method_list)) <= 0) {
+                                fprintf(stderr, "%s: not a list of floats.\n", argv[arg]);
+                                errcount++;
+                            }
+                            for (i = 0; i < early_gain_count; i++){
+                                if (early_gains[i] <= 0){
+                                    fprintf(stderr, "%s: gains must be positive.\n", argv[arg]);
+                                    errcount++;
+                                    break;
+                                }
+                            }
+                        }else{
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
+                        }
+                        break;
+                    case 'A': // aftertouch correction of early notes
+                        early_aftertouch = 1;
+                        break;
+                    case 'K': // spectral flux onset ratio
+                        if ((++arg)<argc){
+                            if (sscanf(argv[arg], "%f%c", &flux_ratio, &bidon) != 1) {
+                                fprintf(stderr, "%s: not a float.\n", argv[arg]);
+                                errcount++;
                             }
                         }else{
                             fprintf(stderr, "%s: missing value.\n", argv[--arg]);
                             errcount++;
                         }
                         break;
-                        /*
-                    case 'n': // midi note number (one per channel)
+                    case 'C': // all inputs on one midi channel
                         if ((++arg)<argc){
-                            if (sscanf(argv[arg], "%d%c", &trigger_level_db, &bidon) != 1) {
-                                fprintf(stderr, "%s: not an integer\n", argv[arg]);
+                            if (sscanf(argv[arg], "%d%c", &single_midi_channel, &bidon) != 1) {
+                                fprintf(stderr, "%s: not an integer.\n", argv[arg]);
+                                errcount++;
+                            }else if (single_midi_channel < 1 || single_midi_channel > 16){
+                                fprintf(stderr, "%s: channel must be 1..16.\n", argv[arg]);
+                                errcount++;
                             }
+                            single_midi_channel--;
                         }else{
-                            fprintf(stderr, "%s: missing value\n", argv[--arg]);
+                            fprintf(stderr, "%s: missing value.\n", argv[--arg]);
+                            errcount++;
                         }
                         break;
-                        */
                     case 't': // (re-)trigger delay in milliseconds
                         if ((++arg)<argc){
                             if (sscanf(argv[arg], "%f%c", &trig_delay_ms, &bidon) != 1) {
@@ -399,7 +4772,6 @@ int main (int argc, char *argv[])
                             errcount++;
                         }
                         break;
-#ifndef method1
                     case 'w': // re-trigger inhibit wait delay in milliseconds
                         if ((++arg)<argc){
                             if (sscanf(argv[arg], "%f%c", &wait_delay_ms, &bidon) != 1) {
@@ -411,7 +4783,6 @@ int main (int argc, char *argv[])
                             errcount++;
                         }
                         break;
-#endif             
                     case 'x': // Extinction (note-off) delay in milliseconds
                         if ((++arg)<argc){
                             if (sscanf(argv[arg], "%f%c", &max_note_off_delay_ms, &bidon) != 1) {
@@ -444,410 +4815,237 @@ int main (int argc, char *argv[])
         exit(-1);
     }
 
-    // Prepare audio device for input
-    if ((err = snd_pcm_open (&capture_handle, device_name, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
-        fprintf (stderr, "cannot open audio device %s (%s)\n", 
-             device_name,
-             snd_strerror(err));
-        exit (1);
-    }else{
-        printf ("audio device set to %s\n", device_name);
+    flux_init();
+    if (benchmark){
+        run_benchmark(sample_format, sample_rate);
+        exit(0);
     }
-       
-    if ((err = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
-        fprintf (stderr, "cannot allocate hardware parameter structure (%s)\n",
-             snd_strerror(err));
-        exit (1);
+    if (run_test_suite){
+        exit(run_tests() ? 1 : 0);
     }
-             
-    if ((err = snd_pcm_hw_params_any (capture_handle, hw_params)) < 0) {
-        fprintf (stderr, "cannot initialize hardware parameter structure (%s)\n",
-             snd_strerror(err));
-        exit (1);
+    if (run_stress_harness){
+        exit(run_stress(sample_format, sample_rate, audio_cpu_count ? audio_cpus[0] : -1) ? 1 : 0);
     }
-
-    if ((err = snd_pcm_hw_params_set_access (capture_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-        fprintf (stderr, "cannot set access type (%s)\n",
-             snd_strerror(err));
-        exit (1);
+    if (synth_file){
+        synth_params p = {channel_counts[0], sample_rate, 30, synth_options[0], synth_options[1], synth_options[2], trigger_level_db, 0};
+        synth_hit *hits;
+        int *samples, hit_count;
+        long long frames = synth_take(&p, &samples, &hits, &hit_count);
+        if (write_wav(synth_file, get_format_info(sample_format == SND_PCM_FORMAT_UNKNOWN ? SND_PCM_FORMAT_S24_3LE : sample_format),
+                p.channels, p.sample_rate, samples, frames, 0x7FFFFF)){
+            exit (1);
+        }
+        // Ground truth, input onset frame and velocity of each hit
+        for (i = 0; i < hit_count; i++){
+            printf("hit %d %lld %d\n", hits[i].input, hits[i].onset, hits[i].velocity);
+        }
+        exit (0);
     }
 
-    if ((err = snd_pcm_hw_params_set_format (capture_handle, hw_params, SND_PCM_FORMAT_S24_3LE)) < 0) {
-        if ((err = snd_pcm_hw_params_set_format (capture_handle, hw_params, SND_PCM_FORMAT_S16_LE)) < 0) {
-            fprintf (stderr, "cannot set sample format (%s)\n",
-                 snd_strerror(err));
-            fprintf (stderr, "use arecord to test your soundcard input format(s)\n");
+    // Prepare audio inputs, the first ALSA device sets the buffer size for the others
+    if (jack_name){
+        if (device_count){
+            fprintf (stderr, "-j cannot be combined with -D or -i\n");
             exit (1);
+        }
+        devices[device_count].name = jack_name;
+        devices[device_count++].is_jack = 1;
+    }
+    if (!device_count){
+        devices[device_count++].name = "default";
+    }
+    for (i = 0; i < device_count; i++){
+        dev = &devices[i];
+        dev->channels = channel_counts[min(i, channel_count_count - 1)];
+        dev->cpu = audio_cpu_count ? audio_cpus[min(i, audio_cpu_count - 1)] + max(i - audio_cpu_count + 1, 0) : -1;
+        if (dev->is_file){
+            err = open_file_source(&dev->source, dev->name, sample_format, sample_rate, dev->channels, paced);
+#ifdef jack
+        }else if (dev->is_jack){
+            err = open_jack_source(&dev->source, dev->name, dev->channels);
+            buf_frames = dev->source.period_frames; // JACK period
+#endif
         }else{
-            channel_bytes = 2;
-            max_sample_value = 0x7FFF;
-            f = find_peak_S16_LE;
-            f_peak = find_channel_peak_S16_LE;
-            f_trig = find_channel_trig_S16_LE;
-            printf ("sample format set to S16_LE\n");
+            err = open_alsa_source(&dev->source, dev->name, sample_format, sample_rate, dev->channels, use_mmap, buf_frames, periods);
+            if (err >= 0 && alsa_count++ && dev->source.period_frames != buf_frames){
+                fprintf (stderr, "%s: period of %lu frames, the first device has %d\n", dev->name, dev->source.period_frames, buf_frames);
+                exit (1);
+            }
+            buf_frames = dev->source.period_frames;
         }
-    }else{
-        channel_bytes = 3;
-        max_sample_value = 0x7FFFFF;
-        f = find_peak_S24_3LE;
-        f_peak = find_channel_peak_S24_3LE;
-        f_trig = find_channel_trig_S24_3LE;
-        printf ("sample format set to S24_3LE\n");
-    }
-    frame_bytes = channels * channel_bytes;
-    buf_bytes = buf_frames * frame_bytes;
-    buf = malloc(buf_bytes);
-
-    if ((err = snd_pcm_hw_params_set_rate_near (capture_handle, hw_params, &sample_rate, 0)) < 0) {
-        // Was 44100, caused a segfault
-        fprintf (stderr, "cannot set sample rate to %u (%s)\n", sample_rate,
-             snd_strerror(err));
-        exit (1);
-    }else{
-        fprintf (stderr, "sample rate set to %u\n", sample_rate);
+        if (err < 0) {
+            exit (1);
+        }
+        // JACK ports are scanned one by one, as mono buffers
+        if ((channel_bytes = select_format(dev->source.format, dev->is_jack ? 1 : dev->source.channels, &dev->max_sample_value, &dev->kernels)) < 0){
+            fprintf (stderr, "unsupported sample format %s\n", snd_pcm_format_name(dev->source.format));
+            exit (1);
+        }
+        printf ("sample format set to %s\n", snd_pcm_format_name(dev->source.format));
+        fprintf (stderr, "sample rate set to %u\n", dev->source.sample_rate);
+        dev->channels = dev->source.channels;
+        fprintf (stderr, "channel count set to %u\n", dev->channels);
+        if (device_count > 1){
+            printf ("%s: channels %d..%d\n", dev->name, total_channels, total_channels + dev->channels - 1);
+        }
+        dev->first_channel = total_channels;
+        total_channels += dev->channels;
+        dev->source.frame_bytes = dev->channels * channel_bytes;
+        // Nothing to gain on unpaced file replay, would starve the output thread
+        dev->realtime = !dev->is_file || paced;
+        dev->queue.wait_when_full = dev->is_file && !paced; // No deadline, do not lose events
+        event_queues[event_queue_count++] = &dev->queue;
     }
-
-    if ((err = snd_pcm_hw_params_set_channels (capture_handle, hw_params, channels)) < 0) {
-        fprintf (stderr, "cannot set channel count to %u (%s)\n", channels,
-             snd_strerror(err));
+    // Copy buffers once the buffer size is settled
+    for (i = 0; i < device_count; i++){
+        dev = &devices[i];
+        if (dev->is_file || (!use_mmap && !dev->is_jack)){
+            dev->source.buf = malloc(buf_frames * dev->source.frame_bytes);
+        }
+    }
+    // Method 3 reports the onsets of a buffer in a 64-bit mask
+    for (i = 0; i < total_channels + compare_count; i++){
+        if ((i < total_channels ? detect_methods[min(i, detect_method_count - 1)] : compare_methods[i - total_channels]) == 3
+            && buf_frames > flux_max_frames){
+            fprintf (stderr, "buffer of %d frames, method 3 takes %d at most\n", buf_frames, flux_max_frames);
+            exit (1);
+        }
+    }
+    map_input(total_channels - 1, &last_midi_channel, &last_note);
+    if (last_note > 127){
+        fprintf (stderr, "%d inputs from note %d go past note 127, lower -n\n", total_channels, base_note);
         exit (1);
-    }else{
-        fprintf (stderr, "channel count set to %u\n", channels);
     }
 
-    if ((err = snd_pcm_hw_params (capture_handle, hw_params)) < 0) {
-        fprintf (stderr, "cannot set parameters (%s)\n",
-             snd_strerror(err));
-        exit (1);
+    if (jack_name){
+        // Notes go to the JACK MIDI port
+    }else if (seq_latency_ms >= 0){
+        if (open_seq_output() < 0){
+            exit (1);
+        }
     }else{
-        fprintf (stderr, "hardware parameters set\n");
+        err = snd_rawmidi_open(NULL, &handle_out, "virtual", 0);
+        if (err) {
+            fprintf(stderr,"snd_rawmidi_open failed: %d\n", err);
+            exit (1); // Unclean
+        }
     }
 
-    snd_pcm_hw_params_free (hw_params);
-
-    if ((err = snd_pcm_prepare (capture_handle)) < 0) {
-        fprintf (stderr, "cannot prepare audio interface for use (%s)\n",
-             snd_strerror(err));
-        exit (1);
-    }else{
-        fprintf (stderr, "audio interface prepared for use\n");
+    latency_channels = total_channels;
+    detect_latency = calloc(total_channels, sizeof(latency_hist));
+    output_latency = calloc(total_channels, sizeof(latency_hist));
+    if (meter_name){
+        open_meter(total_channels);
     }
-    
-    err = snd_rawmidi_open(NULL, &handle_out, "virtual", 0);
-    if (err) {
-        fprintf(stderr,"snd_rawmidi_open failed: %d\n", err);
-        exit (1); // Unclean
+    if (snapshot_dir){
+        if (mkdir(snapshot_dir, 0755) && errno != EEXIST){
+            fprintf (stderr, "cannot create %s (%s)\n", snapshot_dir, strerror(errno));
+            exit (1);
+        }
+        for (i = 0; i < device_count; i++){
+            open_snapshots(&devices[i]);
+        }
+        if ((err = pthread_create(&snapshot_thread_id, NULL, snapshot_writer, NULL))){
+            fprintf(stderr, "cannot start snapshot writer thread (%s)\n", strerror(err));
+            exit (1);
+        }
+        printf ("snapshots of %.1f ms before to %.1f ms after each onset recorded in %s\n",
+            snapshot_window_ms[0], snapshot_window_ms[1], snapshot_dir);
+    }
+    sem_init(&events_ready, 0, 0);
+    if ((err = pthread_create(&output_thread_id, NULL, output_thread_start, NULL))){
+        fprintf(stderr, "cannot start output thread (%s)\n", strerror(err));
+        exit (1);
     }
 
     signal(SIGINT, intHandler);
+    signal(SIGUSR1, usr1Handler);
+    if (control_path){
+        open_control();
+    }
+    atomic_store(&devices_running, device_count);
 
-    // Tested values ok for 128 frames:
-    // trig_delay_buffers = 4, decay_rate = 0.98, decay_factor = 2.0
-    // 4 x 128 frames at 44100 Hz = 11.6 ms
-    // T = 1/ln(0.98) = 49 buffers
-    int waiting[channels], trig_delay_buffers[channels]; // Used for de-bouncing
-    int trig_level[channels];
-    unsigned int max_note_off_delay_bufs;
-    int note_off_delay[channels];
-    int midi_channel[channels], midi_note[channels];
-
-#ifdef meth1            
-     // Method 1 specific
-    float decay[channels], decay_rate[channels], decay_factor[channels];
-    int rising[channels];
-    // These can be used for slope detection
-    //~ int previous[channels];
-    //~ int max_d[channels];
-    int previous_max_l[channels], previous_previous_max_l[channels];
-    int previous_max_v[channels], previous_previous_max_v[channels];
-    int max_l[channels];
-    decay_factor_default = exp(decay_factor_db* log(2)/6.0);
-    printf("decay initial factor %f db, value %f\n", decay_factor_db, decay_factor_default);
-    printf("decay per buffer: %f\n", decay_rate_default);
-#else    
-    // Method 2 specific
-    typedef enum {
-        STATE_IDLE, // Until trig level reached
-        STATE_PEAK, // Scan for peak until time elapsed
-        STATE_WAIT, // Inhibit retrigger until time2 elapsed
-        STATE_UNKNOWN // Only for init
-	} State;
-	const char * state_names[] = {"IDLE", "PEAK", "WAIT"};
-	State state[channels];
-    State old_state[channels];
-	int peak_frames[channels], wait_frames[channels], frame_count[channels];
-	int peak_level[channels];// , trig_frame[channels];
-#endif
-	
-    float ms_per_buffer;
-    long int bufcount=0;
-    
-    frame_bytes = channel_bytes * channels;
-    ms_per_buffer = (buf_frames * 1000.0)/(float)sample_rate;
-    trig_delay_frames_default = roundf(trig_delay_ms * sample_rate) / 1000;
-    trig_delay_buffers_default = trig_delay_frames_default / buf_frames;
-    wait_delay_frames_default = roundf(wait_delay_ms * sample_rate) / 1000;
-    wait_delay_buffers_default = wait_delay_frames_default / buf_frames;
-    trig_level_default = max_sample_value / exp(trigger_level_db * log(2)/-6.0); // FIXME must check >0 !!
-    printf("trigger level %f db factor %u, value %u\n", trigger_level_db, (int)(exp(trigger_level_db * log(2)/-6.0)), trig_level_default);
-
-    max_note_off_delay_bufs = (unsigned int )(max_note_off_delay_ms / ms_per_buffer);
-    printf("note off delay %u buffers (%f ms)\n", max_note_off_delay_bufs, max_note_off_delay_bufs * ms_per_buffer);
-
-    printf("buffer length: %u frames (%u bytes)\n", buf_frames, buf_bytes);
-    printf("time per buffer: %f ms\n", ms_per_buffer);
-    printf("re-trigger delay (buffers): %u (%f ms)\n",
-        trig_delay_buffers_default,
-        trig_delay_buffers_default * ms_per_buffer
-        );
-    printf("re-trigger delay (frames): %u (%f ms)\n",
-        trig_delay_frames_default,
-        (float)trig_delay_frames_default * 1000 / sample_rate
-        );
-
-    int c;
-    for(c = 0; c < channels; c++){
-        // Parameters
-        // FIXME set through command line or other (config file? OSC? midi in?)
-        // FIXME make parameter decay independant of frame size and sample rate
-        // FIXME use sensible units
-        // FIXME should be a struct
-        trig_level[c] = trig_level_default;
-		printf("channel %u trigger level %u\n", c, trig_level[c]);
-#ifdef meth1            
-        trig_delay_buffers[c] = trig_delay_buffers_default;
-        decay_rate[c] = decay_rate_default;
-        decay_factor[c] = decay_factor_default; // Should this depend on sample #?
-        // State variables
-        rising[c] = 0; // Not rising
-        decay[c] = 0.0;
-        waiting[c] = 0; // Not waiting
-        max_l[c] = 0;
-        previous_max_l[c] = 0;
-        previous_previous_max_l[c] = 0;
-#else
-		wait_frames[c] = wait_delay_frames_default;
-		peak_frames[c] = trig_delay_frames_default;
-		printf("channel %u peak window %u frames retrigger inhibit %u frames\n", c, peak_frames[c], wait_frames[c]);
-        state[c]=STATE_IDLE;
-        old_state[c]=STATE_UNKNOWN;
-#endif
-        midi_channel[c] = c & 0x0F; // Default, midi output channels map 1:1 to soundcard inputs
-        midi_note[c] = 60;
-        note_off_delay[c] = 0; // No pending note
-        //~ previous[c] = 0;
-        //~ max_d[c] = 0;
-        
+    // Capture threads and their memory must stay out of the way of paging
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)){
+        fprintf (stderr, "cannot lock memory (%s)\n", strerror(errno));
     }
-    
-    ///////////////
-    // Main loop //
-    ///////////////
-    printf ("About to start reading\n");
-    while (keepRunning) { 
-        if ((err = snd_pcm_readi (capture_handle, buf, buf_frames)) != buf_frames) {
-            fprintf (stderr, "read from audio interface failed (%s)\n",
-                 snd_strerror(err));
-            keepRunning = 0;
-            //~ exit (1);
-        }else{ // Audio read success
-            bufcount++;
-#ifdef debug
-            fprintf (stderr, ".");
+    if (jack_name){
+#ifdef jack
+        run_jack_device(&devices[0]);
 #endif
-#ifdef meth1            
-            for(c = 0; c < channels; c++){
-                previous_previous_max_l[c] = previous_max_l[c];
-                previous_max_l[c] = max_l[c];
-                max_l[c] = 0; // l for level (always positive)
-                previous_previous_max_v[c] = previous_max_v[c];
-                //~ max_d[c] = 0; // d for difference (always positive) // FIXME use previous[c]
+    }else{
+        sem_init(&device_ready, 0, 0);
+        pthread_barrier_init(&devices_start, NULL, device_count);
+        for (i = 0; i < device_count; i++){
+            if ((err = pthread_create(&devices[i].thread, NULL, capture_thread, &devices[i]))){
+                fprintf(stderr, "cannot start capture thread (%s)\n", strerror(err));
+                exit (1);
             }
-            // Format-dependant peak detection
-            (*f)(channels, buf, max_l, previous_max_l, previous_max_v);//, previous_previous_max_l, previous_previous_max_v);
-
-            // React to peak in current, previous and before previous buffer
-            // Will wait actual decay before sending, i.e. max_l < previous_max_l
-            // test showed max rising for 4 buffers at 44100Hz, 64 frames per buffer (~6ms)
-            // 6ms max reaction time should be ok when playing
-            for(c = 0; c < channels; c++){
-                if (rising[c]){ // Trigger detected in previous buffer
-                    rising[c]++; // For stats; should we set a limit?
-#ifdef debug
-                    //~ fprintf (stderr, "r");
-#endif
-                    // Requiring 2 consecutive falling buffers can audibly increase latency
-                    if ((max_l[c] < previous_max_l[c]) && (single_buffer || (previous_max_l[c] < previous_previous_max_l[c]))){
-#ifdef debug
-                        fprintf (stderr, "f %u ", rising[c]);
-#endif
-                        rising[c] = 0; // no longer rising
-                        waiting[c] = trig_delay_buffers[c]; // Start or restart wait period
-                        //~ decay[c] = (float)(previous_max_l[c] - trig_level[c]) * decay_factor[c]; // ... and envelope
-                        decay[c] = (float)(previous_previous_max_l[c] - trig_level[c]) * decay_factor[c]; // ... and envelope
-                        // Prepare to send a note off after a certain number of frames
-                        // could make it depend on hit strength?
-#ifdef debug
-                        fprintf (stderr, "\nI %u %u %lu ", c, note_off_delay[c], bufcount);
-#endif
-                        if(force_note_off && note_off_delay[c]){
-                            send_note_off(midi_channel[c], midi_note[c]);
-#ifdef debug
-                            fprintf (stderr, "\nX %u %u %lu ", c, note_off_delay[c], bufcount);
-#endif
-                        }
-                        note_off_delay[c] = max_note_off_delay_bufs;
-                        //~ send_note_on(midi_channel[c], midi_note[c], previous_max_v[c]);
-                        send_note_on(midi_channel[c], midi_note[c], previous_previous_max_v[c]);
-#ifdef debug
-                        fprintf (stderr, "\n! %u %d %lu ", c, previous_previous_max_v[c], bufcount);
-#endif
-                    }
-                }else if (waiting[c]){
-                    waiting[c]--;
-#ifdef debug
-                    fprintf (stderr, "w %u", c);
-#endif
-                }else{ // Decaying, ready for trigger
-                    if (max_l[c] > (trig_level[c] + decay[c])){ // Trigger found in this buffer
-                        rising[c] = 1;
-                    }
-                    if (decay[c] < 1.0){
-#ifdef debug
-                        //~ fprintf (stderr,".");
-#endif
-                        decay[c] = 0.0;
-                    }else{
-#ifdef debug
-                        //~ fprintf (stderr, "d");
-                        //~ fprintf (stderr, "d %u %f\n", c, decay[c]);
-#endif
-                        decay[c] *= decay_rate[c];
-                    }
-                }
-                //~ fprintf (stderr, ". %u %u", c, note_off_delay[c]);
-                // Note off handling
-                if (note_off_delay[c]){
-                    note_off_delay[c]--;
-#ifdef debug
-                    fprintf (stderr, "n %u %u ", c, note_off_delay[c]);
-#endif
-                    if (note_off_delay[c] <= 0){
-                        note_off_delay[c] = 0;
-#ifdef debug
-                        fprintf (stderr, "\nx %u %lu ", c, bufcount);
-#endif
-                        send_note_off(midi_channel[c], midi_note[c]);
-                    }
-                }
-            } // End of loop for channels, method 1
-#else // method 2
-// Looking for peak can span multiple buffers
-// timing  should be sample-accurate but midi isn't!
-            int remaining_frames; // Remaining in current buffer
-            int trig_frame, peak_frame, span;
-            int velocity;
-            char * buf_tail;
-            for(c = 0; c < channels; c++){
-				// Should have a loop to handle tail of buffer
-				remaining_frames = buf_frames;
-				buf_tail = buf;
-				// Sate will not necessarily extend to end of buffer,
-				// we need to loop over buffer chunks.
-				while (remaining_frames>0) {
-#ifdef debug					
-					if (state[c]!=old_state[c]){
-					    // fprintf (stderr, "%c %u %u->", state_names[old_state[c]][0], c, remaining_frames);
-					    fprintf (stderr, "%c %u %u ", state_names[state[c]][0], c, remaining_frames);
-					    old_state[c]=state[c];
-					}
-#endif					
-					switch (state[c]){
-						case STATE_IDLE:
-							// Look if trigger level is reached
-							trig_frame=(*f_trig)(channels, buf_tail, remaining_frames, c, trig_level[c]);
-							if (trig_frame>=0){  // Trigger level was reached
-								buf_tail += frame_bytes * (trig_frame+1);
-								remaining_frames -= trig_frame+1;
-#ifdef debug
-								fprintf (stderr, "t%u r%u ", trig_frame, remaining_frames);
-#endif								
-								// prepare for next stage
-								state[c] = STATE_PEAK;
-								peak_level[c] = trig_level[c];
-								frame_count[c] = peak_frames[c];
-							}else{ // Trigger level was not reached in this buffer
-								remaining_frames = 0; // Maybe in next buffer...
-								// State stays STATE_IDLE
-							}
-							break;
-						case STATE_PEAK:
-							// look for peak within allowed time frame
-							span = min(remaining_frames, frame_count[c]);
-							(*f_peak)(channels, buf_tail, span, c, &peak_level[c]);
-							frame_count[c] -= span;
-							buf_tail += frame_bytes * span;
-							remaining_frames -= span;
-							if (frame_count[c]<=0){ // Is end of peak measurement window reached?
-								velocity = 1+126*(peak_level[c]-trig_level[c])/(max_sample_value-trig_level[c]);
-#ifdef debug								
-								fprintf (stderr, "p:%u v:%u\n", peak_level[c], velocity);
-#endif								
-								// Send MIDI note
-								send_note_on(midi_channel[c], midi_note[c], velocity);
-								state[c] = STATE_WAIT;
-								// FIXME should be from actual peak frame
-								// but this is not necessarily in the current buffer
-								frame_count[c] += wait_frames[c];
-								note_off_delay[c] = max_note_off_delay_bufs;
-#ifdef debug
-							}else{
-								fprintf (stderr, "p");
-#endif
-							}
-							break;
-						default: // case STATE_WAIT:
-							frame_count[c] -= buf_frames;
-							// do nothing until retrigger guard is reached
-							if (frame_count[c]<=0){
-								// frame_count[c]+=buf_frames;
-								state[c] = STATE_IDLE;
-								remaining_frames = -frame_count[c];
-								buf_tail = buf + frame_bytes * (buf_frames - remaining_frames);
-							}else{ // Wait for whole buffer duration
-#ifdef debug
-								fprintf (stderr, "w");
-#endif
-								remaining_frames = 0;
-							}
-							break;
-					} // End of switch
-				} // End of while buffer chunk loop
-                if (note_off_delay[c]){
-                    note_off_delay[c]--;
-#ifdef debug
-                    fprintf (stderr, "n %u %u ", c, note_off_delay[c]);
-#endif
-                    if (note_off_delay[c] <= 0){
-                        note_off_delay[c] = 0;
-#ifdef debug
-                        fprintf (stderr, "\nx %u %lu ", c, bufcount);
-#endif
-                        send_note_off(midi_channel[c], midi_note[c]);
-                    }
-                }
-			} // End of loop for channels, method 2
-#endif
-        } // end of else read success
-    } // end of main read loop
+            sem_wait(&device_ready); // Setup messages of each device in one piece
+        }
+        event_loop();
+        for (i = 0; i < device_count; i++){
+            pthread_join(devices[i].thread, NULL);
+        }
+    }
 
     printf ("Terminating...\n");
-    snd_pcm_close(capture_handle);
+    if (control_path){
+        close_control();
+    }
+    if (snapshot_dir){
+        atomic_store(&snapshot_stop, 1);
+        pthread_join(snapshot_thread_id, NULL);
+        for (i = 0; i < device_count; i++){
+            dev = &devices[i];
+            printf ("%s: %u snapshots written", dev->name, dev->snapshots->written);
+            if (dev->snapshots->dropped){
+                printf (", %u dropped, queue full", dev->snapshots->dropped);
+            }
+            printf ("\n");
+            close_snapshots(dev);
+        }
+    }
+    if (meter){
+        close_meter();
+    }
+    atomic_store(&output_stop, 1);
+    sem_post(&events_ready);
+    pthread_join(output_thread_id, NULL);
+    print_latency();
+    for (i = 0; i < device_count; i++){
+        dev = &devices[i];
+        if (dev->xruns){
+            fprintf (stderr, "%s: %u overruns, %lld frames lost, longest recovery %.2f ms\n", dev->name, dev->xruns, dev->frames_lost, dev->max_recovery_ms);
+        }
+        if (dev->queue.dropped){
+            fprintf (stderr, "%s: %u output events dropped\n", dev->name, dev->queue.dropped);
+        }
+    }
+#ifdef jack
+    if (jack_dropped){
+        fprintf (stderr, "%u MIDI events dropped, JACK MIDI buffer full\n", jack_dropped);
+    }
+#endif
+    if (seq_handle){
+        if (late_events){
+            fprintf (stderr, "%u notes sent late, consider a larger -S delay\n", late_events);
+        }
+        // Let scheduled notes play before the queue goes away
+        struct timespec pause = {0, 0};
+        timespec_add_ns(&pause, (long long)(seq_latency_ms * 1e6));
+        nanosleep(&pause, NULL);
+        snd_midi_event_free(seq_encoder);
+        snd_seq_close(seq_handle);
+    }
+    for (i = 0; i < device_count; i++){
+        devices[i].source.close(&devices[i].source);
+        free(devices[i].source.buf);
+    }
     if (handle_out) {
             snd_rawmidi_drain(handle_out); 
             snd_rawmidi_close(handle_out);  
     }
-    if (buf) free(buf);
     exit (0);
 }
 
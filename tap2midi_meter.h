@@ -0,0 +1,54 @@
+// Tap 2 MIDI meters
+// Layout of the shared memory segment published by tap2midi -O name, read by tap2meter
+// Each capture thread rewrites the block of its device once per period, seqlock style:
+// the sequence number is odd while it writes, a reader copies the block and retries if the
+// sequence was odd or has changed meanwhile. The capture thread never waits for readers.
+
+#ifndef TAP2MIDI_METER_H
+#define TAP2MIDI_METER_H
+
+#include <stdatomic.h>
+
+#define meter_magic (0x4D32544DU) // "MT2M"
+#define meter_version (1)
+#define meter_max_devices (8)
+
+typedef enum {
+    METER_IDLE, // Waiting for a trigger
+    METER_PEAK, // Measuring the peak of a hit, methods 2 and 3
+    METER_WAIT, // Retrigger inhibit
+    METER_RISING, // Hit found, waiting for the level to fall, method 1
+    METER_DECAY // Envelope decaying, method 1
+} meter_state;
+
+typedef struct {
+    int method;
+    int state; // meter_state
+    float level; // Peak of the last period, 1.0 is full scale
+    float trigger; // Trigger level
+    float envelope; // Method 1 decaying envelope, above the trigger level
+    int velocity; // Of the last note on, 0 before the first one
+    unsigned int notes; // Note ons sent
+} meter_channel;
+
+typedef struct {
+    atomic_uint seq; // Odd while the block and its channels are written
+    unsigned int first_channel, channels;
+    unsigned int sample_rate, period_frames;
+    unsigned long long periods; // Processed
+    unsigned int xruns;
+    long long frames_lost;
+} meter_device;
+
+typedef struct {
+    atomic_uint magic; // Stored last, once the layout is filled in
+    unsigned int version;
+    atomic_int running; // 0 once tap2midi has stopped
+    unsigned int device_count, channel_count;
+    meter_device devices[meter_max_devices];
+    meter_channel channels[]; // channel_count, numbered as the inputs
+} meter_segment;
+
+#define meter_segment_size(channel_count) (sizeof(meter_segment) + (channel_count) * sizeof(meter_channel))
+
+#endif